@@ -0,0 +1,315 @@
+// --------
+// includes
+// --------
+
+#include <chrono>    // steady_clock
+#include <cstdlib>   // atoi
+#include <ctime>     // gmtime, strftime, time
+#include <iostream>  // cout
+#include <string>    // string
+#include <vector>    // vector
+
+#include "Darwin.h"
+
+// ----------
+// benchmarks
+// ----------
+
+/*
+ * Every benchmark prints one JSON object per line, so runs can be
+ * appended to a file and compared over time. Each object starts with
+ * the run id (the makefile passes git describe) and the UTC start time.
+ * usage: BenchDarwin [max_size [threads [run_id]]]
+ * A threads of 0 instead steps the largest World with 1, 2, 4 .. 32
+ * threads, to show how World::step scales.
+ */
+
+typedef std::chrono::steady_clock bench_clock;
+
+/* the "run" and "time" fields every record starts with */
+std::string run_fields;
+
+/*
+ * @param s a string
+ * @return s as a JSON string literal
+ */
+std::string json_string(const std::string& s){
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++){
+        if (s[i] == '"' || s[i] == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(s[i]) >= ' ')
+            out += s[i];
+    }
+    return out + "\"";
+}
+
+/*
+ * @return the seconds elapsed since a time point
+ */
+double seconds_since(bench_clock::time_point start){
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/*
+ * Times Creature::take_turn for one creature walled into a 1x1 World,
+ * so every turn runs the program's wall branch and never moves
+ */
+void bench_dispatch(const char* name, Species& s, dispatch mode){
+    using namespace std;
+    const int turns = 2000000;
+    World w(1, 1);
+    w.set_random(Random(1));
+    w.set_dispatch(mode);
+    w.add_creature(&s, north, Location(0, 0));
+    const bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < turns; i++)
+        w.step();
+    const double elapsed = seconds_since(start);
+    cout << "{" << run_fields
+         << "\"bench\": \"dispatch\", \"species\": \"" << name
+         << "\", \"mode\": \"" << (mode == compiled ? "compiled" : "interpreted")
+         << "\", \"ns_per_turn\": " << elapsed * 1e9 / turns << "}" << endl;
+}
+
+/*
+ * Times if_empty, if_wall, if_enemy and look over every square and
+ * direction of a half-full 256x256 World
+ */
+void bench_queries(Species& a, Species& b){
+    using namespace std;
+    const int size = 256;
+    World w(size, size);
+    for (int r = 0; r < size; r++)
+        for (int c = r % 2; c < size; c += 2)
+            w.add_creature((r / 2 + c / 2) % 2 ? &a : &b, north, Location(r, c));
+
+    const char* const names[] = {"if_empty", "if_wall", "if_enemy", "look"};
+    for (int q = 0; q < 4; q++){
+        const int rounds = 20;
+        long long found = 0;
+        const bench_clock::time_point start = bench_clock::now();
+        for (int k = 0; k < rounds; k++){
+            for (int r = 0; r < size; r++){
+                // if_enemy and look need a creature in the square
+                for (int c = q >= 2 ? r % 2 : 0; c < size; c += q >= 2 ? 2 : 1){
+                    const Location l(r, c);
+                    for (int d = west; d <= south; d++){
+                        const direction dir = static_cast<direction>(d);
+                        switch (q){
+                            case 0: found += w.if_empty(l, dir); break;
+                            case 1: found += w.if_wall(l, dir); break;
+                            case 2: found += w.if_enemy(l, dir); break;
+                            case 3: found += w.look(l, dir); break;
+                        }
+                    }
+                }
+            }
+        }
+        const double elapsed = seconds_since(start);
+        const double queries = 4.0 * rounds * size * (q >= 2 ? size / 2 : size);
+        cout << "{" << run_fields
+             << "\"bench\": \"query\", \"query\": \"" << names[q]
+             << "\", \"ns_per_query\": " << elapsed * 1e9 / queries
+             << ", \"checksum\": " << found << "}" << endl;
+    }
+}
+
+/*
+ * Times World::move shuttling every creature of a sparse World east
+ * and back, and World::infect converting columns of enemies
+ */
+void bench_move_infect(Species& a, Species& b){
+    using namespace std;
+    const int size = 512;
+    {
+        World w(size, size);
+        for (int r = 0; r < size; r++)
+            for (int c = 0; c < size; c += 2)
+                w.add_creature(&a, east, Location(r, c));
+        const int rounds = 10;
+        const bench_clock::time_point start = bench_clock::now();
+        for (int k = 0; k < rounds; k++){
+            for (int r = 0; r < size; r++){
+                for (int c = 0; c < size; c += 2){
+                    w.move(Location(r, c), east);
+                    w.move(Location(r, c + 1), west);
+                }
+            }
+        }
+        const double elapsed = seconds_since(start);
+        cout << "{" << run_fields << "\"bench\": \"move\", \"ns_per_move\": "
+             << elapsed * 1e9 / (2.0 * rounds * size * size / 2) << "}" << endl;
+    }
+    {
+        World w(size, size);
+        for (int r = 0; r < size; r++)
+            for (int c = 0; c < size; c++)
+                w.add_creature(c % 2 ? &b : &a, east, Location(r, c));
+        const bench_clock::time_point start = bench_clock::now();
+        for (int r = 0; r < size; r++)
+            for (int c = 0; c < size; c += 2)
+                w.infect(Location(r, c), east);
+        const double elapsed = seconds_since(start);
+        cout << "{" << run_fields << "\"bench\": \"infect\", \"ns_per_infect\": "
+             << elapsed * 1e9 / (size * size / 2) << "}" << endl;
+    }
+}
+
+/*
+ * Times World::step on a seeded World of a given size, density and mix
+ * of species, running enough steps to cover about 2^24 squares
+ */
+void bench_step(const char* mix, const std::vector<Species*>& species,
+                int size, double density, int threads){
+    using namespace std;
+    const long long cells = static_cast<long long>(size) * size;
+    Scenario s(size, size, 0);
+    for (size_t i = 0; i < species.size(); i++)
+        s.add_species(species[i], density * cells / species.size());
+    World w(size, size);
+    w.set_threads(threads);
+    const bench_clock::time_point setup = bench_clock::now();
+    s.populate(w, 1);
+    const double setup_time = seconds_since(setup);
+    vector<int> counts;
+    w.census(species, counts);
+    long long creatures = 0;
+    for (size_t i = 0; i < counts.size(); i++)
+        creatures += counts[i];
+
+    const int steps = max(1LL, (1LL << 24) / cells);
+    const bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < steps; i++)
+        w.step();
+    const double elapsed = seconds_since(start);
+    // collisions are dropped while populating, so report the fill reached
+    cout << "{" << run_fields
+         << "\"bench\": \"step\", \"mix\": \"" << mix
+         << "\", \"size\": " << size
+         << ", \"target_density\": " << density
+         << ", \"density\": " << static_cast<double>(creatures) / cells
+         << ", \"threads\": " << threads << ", \"creatures\": " << creatures
+         << ", \"steps\": " << steps
+         << ", \"setup_ms\": " << setup_time * 1e3
+         << ", \"ns_per_step\": " << elapsed * 1e9 / steps
+         << ", \"creature_turns_per_s\": " << creatures * steps / elapsed
+         << "}" << endl;
+}
+
+// ----
+// main
+// ----
+
+int main (int argc, char* argv[]){
+
+    // ----
+    // food
+    // ----
+
+    Species food("food");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+
+    // ------
+    // hopper
+    // ------
+
+    Species hopper("hopper");
+    hopper.add_instruction({hop});
+    hopper.add_instruction({go, 0});
+    hopper.complete();
+
+    // -----
+    // rover
+    // -----
+
+    Species rover("rover");
+    rover.add_instruction({if_enemy, 9});  // 0: if_enemy 9
+    rover.add_instruction({if_empty, 7});  // 1: if_empty 7
+    rover.add_instruction({if_random, 5}); // 2: if_random 5
+    rover.add_instruction({left});         // 3: left
+    rover.add_instruction({go, 0});        // 4: go 0
+    rover.add_instruction({right});        // 5: right
+    rover.add_instruction({go, 0});        // 6: go 0
+    rover.add_instruction({hop});          // 7: hop
+    rover.add_instruction({go, 0});        // 8: go 0
+    rover.add_instruction({infect});       // 9: infect
+    rover.add_instruction({go, 0});        //10: go 0
+    rover.complete();
+
+    // ----
+    // trap
+    // ----
+
+    Species trap("trap");
+    trap.add_instruction({if_enemy, 3}); // 0: if_enemy 3
+    trap.add_instruction({left});        // 1: left
+    trap.add_instruction({go, 0});       // 2: go 0
+    trap.add_instruction({infect});      // 3: infect
+    trap.add_instruction({go, 0});       // 4: go 0
+    trap.complete();
+
+    // ----
+    // best
+    // ----
+
+    Species best("best");
+    best.add_instruction({if_empty, 6});    // 0: if_empty 6
+    best.add_instruction({if_enemy, 4});    // 1: if_enemy 4
+    best.add_instruction({left});           // 2: left
+    best.add_instruction({go, 0});          // 3: go 0
+    best.add_instruction({infect});         // 4: infect
+    best.add_instruction({go, 0});          // 5: go 0
+    best.add_instruction({hop});            // 6: hop
+    best.add_instruction({go, 0});          // 7: go 0
+    best.complete();
+
+    using namespace std;
+
+    const int max_size = argc > 1 ? atoi(argv[1]) : 4096;
+    const int threads = argc > 2 ? atoi(argv[2]) : 1;
+    const string run = argc > 3 ? argv[3] : "unknown";
+    const time_t now = time(0);
+    char started[32];
+    strftime(started, sizeof started, "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    run_fields = "\"run\": " + json_string(run) +
+                 ", \"time\": " + json_string(started) + ", ";
+
+    // micro benchmarks
+
+    const char* const names[] = {"food", "hopper", "rover", "trap", "best"};
+    Species* const programs[] = {&food, &hopper, &rover, &trap, &best};
+    for (int i = 0; i < 5; i++){
+        bench_dispatch(names[i], *programs[i], compiled);
+        bench_dispatch(names[i], *programs[i], interpreted);
+    }
+    bench_queries(food, trap);
+    bench_move_infect(hopper, food);
+
+    // macro benchmarks
+
+    vector<Species*> classic(programs, programs + 4);
+    vector<Species*> all(programs, programs + 5);
+    vector<Species*> hunters;
+    hunters.push_back(&rover);
+    hunters.push_back(&best);
+    if (threads == 0){
+        for (int t = 1; t <= 32; t *= 2){
+            bench_step("classic", classic, max_size, 0.5, t);
+            bench_step("rover+best", hunters, max_size, 0.5, t);
+        }
+        return 0;
+    }
+    const double densities[] = {0.1, 0.5};
+    for (int size = 8; size <= max_size; size *= 2){
+        for (int d = 0; d < 2; d++){
+            bench_step("classic", classic, size, densities[d], threads);
+            bench_step("all", all, size, densities[d], threads);
+            bench_step("rover+best", hunters, size, densities[d], threads);
+        }
+    }
+
+    return 0;
+}
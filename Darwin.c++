@@ -1,12 +1,85 @@
 #include "Darwin.h"
 #include <cassert>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* Species */
 
+static uint64_t mix(uint64_t);
+
+/* the most Species alive at once, as a Creature holds their id in 16 bits */
+const int max_species = 1 << 16;
+
+/* live_species[id] is the live Species holding id, or null */
+static Species* live_species[max_species];
+/* ids given back by destroyed Species */
+static std::vector<uint16_t> free_ids;
+/* the next id never handed out */
+static int fresh_id = 0;
+static std::mutex species_lock;
+
+/*
+ * Hands out an id for a new Species
+ * @param s the new species
+ * @return an id no live Species holds
+ * @throw runtime_error when every id is taken
+ */
+static uint16_t register_species(Species* s){
+    std::lock_guard<std::mutex> guard(species_lock);
+    uint16_t id;
+    if (!free_ids.empty()){
+        id = free_ids.back();
+        free_ids.pop_back();
+    } else if (fresh_id < max_species){
+        id = fresh_id++;
+    } else {
+        throw std::runtime_error("Too many live Species.");
+    }
+    live_species[id] = s;
+    return id;
+}
+
+Species::Species(std::string n) :
+        name(n), completed(false), random(false),
+        id(register_species(this)), digest(0) {}
+
+Species::Species(const Species& o) :
+        instructions(o.instructions), transitions(o.transitions),
+        chains(o.chains), name(o.name), completed(o.completed), random(o.random),
+        id(register_species(this)), digest(o.digest) {}
+
+Species::~Species(){
+    std::lock_guard<std::mutex> guard(species_lock);
+    live_species[id] = 0;
+    free_ids.push_back(id);
+}
+
+Species* Species::with_id(uint16_t id){
+    return live_species[id];
+}
+
 void Species::add_instruction(Instruction k){
     assert(!completed);
     instructions.push_back(k);
+    if (k.h == if_random)
+        random = true;
 }
 
 Instruction Species::next_move(const int pc) const {
@@ -14,6 +87,136 @@ Instruction Species::next_move(const int pc) const {
     return instructions.at(pc);
 }
 
+/* number of sight values, the row length of Species::transitions */
+const int sights = 4;
+
+/* a transition that has to be left to the interpreter */
+const Instruction unresolved = {go, -1};
+
+const Instruction& Species::next_action(const int pc, const sight s) const {
+    assert(completed);
+    if (pc < 0 || pc >= static_cast<int>(instructions.size()))
+        return unresolved;
+    return transitions[pc * sights + s];
+}
+
+/* control-flow instructions counted by Species::chain_counts */
+const int chain_kinds = 4;
+
+#ifdef DARWIN_METRICS
+/*
+ * @return the position of a control-flow instruction in a chain count,
+ *         or -1 for other instructions
+ */
+static int chain_kind(creature_behavior h){
+    switch (h){
+        case if_empty: return 0;
+        case if_wall: return 1;
+        case if_enemy: return 2;
+        case go: return 3;
+        default: return -1;
+    }
+}
+#endif
+
+const int* Species::chain_counts(const int pc, const sight s) const {
+    static const int none[chain_kinds] = {0, 0, 0, 0};
+    assert(completed);
+    if (chains.empty() || pc < 0 ||
+        pc >= static_cast<int>(instructions.size()))
+        return none;
+    return &chains[(pc * sights + s) * chain_kinds];
+}
+
+void Species::compile(){
+    using namespace std;
+    enum {unvisited, on_path, resolved};
+    const int size = instructions.size();
+    transitions.assign(size * sights, unresolved);
+#ifdef DARWIN_METRICS
+    chains.assign(size * sights * chain_kinds, 0);
+#endif
+    vector<char> state(size * sights, unvisited);
+    vector<int> path;
+
+    for (int s = 0; s < sights; s++){
+        for (int start = 0; start < size; start++){
+            if (state[start * sights + s] == resolved)
+                continue;
+            path.clear();
+            Instruction result = unresolved;
+            int pc = start;
+            int joined = -1; // the resolved entry the path ran into
+            bool done = false;
+            while (!done){
+                if (pc < 0 || pc >= size)
+                    break;
+                const int k = pc * sights + s;
+                if (state[k] == resolved){
+                    result = transitions[k];
+                    joined = k;
+                    break;
+                }
+                if (state[k] == on_path)
+                    break; // control flow loops without acting
+                state[k] = on_path;
+                path.push_back(pc);
+                const Instruction& i = instructions[pc];
+                switch (i.h){
+                    case hop:
+                    case creature_behavior::left:
+                    case creature_behavior::right:
+                    case creature_behavior::infect:
+                        result.h = i.h;
+                        result.n = pc + 1;
+                        done = true;
+                        break;
+                    case if_random:
+                        result.h = if_random;
+                        result.n = pc;
+                        done = true;
+                        break;
+                    case if_empty:
+                        pc = s == sees_empty ? i.n : pc + 1;
+                        break;
+                    case if_wall:
+                        pc = s == sees_wall ? i.n : pc + 1;
+                        break;
+                    case if_enemy:
+                        pc = s == sees_enemy ? i.n : pc + 1;
+                        break;
+                    case creature_behavior::go:
+                        pc = i.n;
+                        break;
+                }
+            }
+            for (size_t j = 0; j < path.size(); j++){
+                const int k = path[j] * sights + s;
+                transitions[k] = result;
+                state[k] = resolved;
+            }
+#ifdef DARWIN_METRICS
+            if (result.h != go){
+                // count backwards from the end of the chain
+                int counts[chain_kinds] = {0, 0, 0, 0};
+                if (joined >= 0)
+                    copy(&chains[joined * chain_kinds],
+                         &chains[(joined + 1) * chain_kinds], counts);
+                for (size_t j = path.size(); j-- > 0;){
+                    const int kind = chain_kind(instructions[path[j]].h);
+                    if (kind >= 0)
+                        counts[kind]++;
+                    copy(counts, counts + chain_kinds,
+                         &chains[(path[j] * sights + s) * chain_kinds]);
+                }
+            }
+#else
+            static_cast<void>(joined);
+#endif
+        }
+    }
+}
+
 void Species::complete(){
     assert(!completed);
     if (instructions.size() == 0){
@@ -21,29 +224,72 @@ void Species::complete(){
     }
     completed = true;
     instructions.shrink_to_fit();
+    compile();
+    digest = instructions.size();
+    for (size_t pc = 0; pc < instructions.size(); pc++){
+        const Instruction& k = instructions[pc];
+        digest = mix(digest ^ (static_cast<uint64_t>(k.h) << 32 |
+                               static_cast<uint32_t>(k.n)));
+    }
 }
 
-void Species::print_short_name(std::ostream& o){
-    using namespace std;
+void Species::print_short_name(std::ostream& o) const {
+    o << short_name();
+}
+
+char Species::short_name() const {
     assert(name.length() > 0);
-    o << name[0];
+    return name[0];
 }
 
 bool Species::ready() const {
     return completed;
 }
 
+int Species::program_size() const {
+    return instructions.size();
+}
+
+bool Species::draws_random() const {
+    return random;
+}
+
+bool Species::total() const {
+    assert(completed);
+    for (size_t k = 0; k < transitions.size(); k++)
+        if (transitions[k].h == go)
+            return false;
+    return true;
+}
+
+uint64_t Species::program_hash() const {
+    return digest;
+}
+
 /* end Species */
 
 /* Creature */
 
+static_assert(sizeof(Creature) <= 12, "a Creature packs into 12 bytes");
+
+Creature::Creature(Species* s, direction d) :
+        pc(0), turns(0), kind(s->id), facing(d) {}
+
+const Species* Creature::species() const {
+    return Species::with_id(kind);
+}
+
 void Creature::infect(Creature& target){
     target.pc = 0;
-    target.behavior = behavior;
+    target.kind = kind;
+}
+
+direction Creature::heading() const {
+    return static_cast<direction>(facing);
 }
 
 void Creature::turn_left(){
-    switch (facing) {
+    switch (heading()) {
         case west:
             facing = south;
             break;
@@ -60,7 +306,7 @@ void Creature::turn_left(){
 }
 
 void Creature::turn_right(){
-    switch (facing) {
+    switch (heading()) {
         case west:
             facing = north;
             break;
@@ -77,16 +323,92 @@ void Creature::turn_right(){
 }
 
 void Creature::print(std::ostream& o) const {
-    behavior->print_short_name(o);
+    species()->print_short_name(o);
 }
 
+#ifdef DARWIN_METRICS
+/*
+ * Counts the instructions behind one compiled transition
+ * @param m the counters to add to
+ * @param chain the control-flow counts from Species::chain_counts
+ * @param h the instruction the chain ends in (go when unresolved, which
+ *        the interpreter counts itself)
+ */
+static void count_chain(Metrics& m, const int* chain, creature_behavior h){
+    m.count_instruction(if_empty, chain[0]);
+    m.count_instruction(if_wall, chain[1]);
+    m.count_instruction(if_enemy, chain[2]);
+    m.count_instruction(go, chain[3]);
+    if (h != go)
+        m.count_instruction(h, 1);
+}
+#endif
+
 void Creature::take_turn(World& w, Location l){
+    if (w.interpreting()){
+        interpret(w, l);
+        return;
+    }
+    const Species* const behavior = species();
+    const sight s = w.look(l, heading());
+    int draws = 0;
+    bool action = false;
+    while (!action){
+        const Instruction& t = behavior->next_action(pc, s);
+#ifdef DARWIN_METRICS
+        count_chain(w.tally(), behavior->chain_counts(pc, s), t.h);
+#endif
+        switch (t.h){
+            case hop:
+                if (s == sees_empty)
+                    w.move(l, heading());
+                else
+                    DARWIN_COUNT(w, count_move(false));
+                action = true;
+                pc = t.n;
+                break;
+            case left:
+                turn_left();
+                action = true;
+                pc = t.n;
+                break;
+            case right:
+                turn_right();
+                action = true;
+                pc = t.n;
+                break;
+            case creature_behavior::infect:
+                if (s == sees_enemy)
+                    w.infect(l, heading());
+                action = true;
+                pc = t.n;
+                break;
+            case if_random:
+                if (w.if_random(l, draws++))
+                    pc = behavior->next_move(t.n).n;
+                else
+                    pc = t.n + 1;
+                break;
+            default:
+                // the chain loops or leaves the program
+                interpret(w, l);
+                return;
+        }
+    }
+    turns++;
+    DARWIN_COUNT(w, count_action());
+}
+
+void Creature::interpret(World& w, Location l){
+    const Species* const behavior = species();
+    int draws = 0;
     bool action = false;
     while (!action){
         Instruction i = behavior->next_move(pc);
+        DARWIN_COUNT(w, count_instruction(i.h, 1));
         switch (i.h){
             case hop:
-                w.move(l, facing);
+                w.move(l, heading());
                 action = true;
                 pc++;
                 break;
@@ -101,24 +423,24 @@ void Creature::take_turn(World& w, Location l){
                 pc++;
                 break;
             case creature_behavior::infect:
-                w.infect(l, facing);
+                w.infect(l, heading());
                 action = true;
                 pc++;
                 break;
             case if_empty:
-                if (w.if_empty(l, facing))
+                if (w.if_empty(l, heading()))
                     pc = i.n;
                 else
                     pc++;
                 break;
             case if_wall:
-                if (w.if_wall(l, facing))
+                if (w.if_wall(l, heading()))
                     pc = i.n;
                 else
                     pc++;
                 break;
             case if_enemy:
-                if (w.if_enemy(l, facing))
+                if (w.if_enemy(l, heading()))
                     pc = i.n;
                 else
                     pc++;
@@ -127,7 +449,7 @@ void Creature::take_turn(World& w, Location l){
                 pc = i.n;
                 break;
             case if_random:
-                if (rand() % 2) //odd number
+                if (w.if_random(l, draws++))
                     pc = i.n;
                 else
                     pc++;
@@ -135,6 +457,7 @@ void Creature::take_turn(World& w, Location l){
         }
     }
     turns++;
+    DARWIN_COUNT(w, count_action());
 }
 
 bool Creature::has_taken_turns(int n) const {
@@ -163,39 +486,302 @@ Location Location::operator +(direction d) const {
     return Location(y, x);
 }
 
+/* Metrics */
+
+Metrics::Metrics() :
+        actions(0), moved(0), blocked(0), steps(0), step_seconds(0),
+        last_step(0) {
+    std::fill(instructions, instructions + behaviors, 0);
+}
+
+bool Metrics::enabled(){
+#ifdef DARWIN_METRICS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Metrics::count_instruction(creature_behavior h, long long n){
+    instructions[h] += n;
+}
+
+void Metrics::count_action(){
+    actions++;
+}
+
+void Metrics::count_move(bool success){
+    if (success)
+        moved++;
+    else
+        blocked++;
+}
+
+void Metrics::count_infection(const Species* from, const Species* to){
+    infected[std::make_pair(from, to)]++;
+}
+
+void Metrics::count_step(double seconds){
+    steps++;
+    step_seconds += seconds;
+    last_step = seconds;
+}
+
+void Metrics::merge(const Metrics& o){
+    using namespace std;
+    for (int h = 0; h < behaviors; h++)
+        instructions[h] += o.instructions[h];
+    actions += o.actions;
+    moved += o.moved;
+    blocked += o.blocked;
+    for (map<pair<const Species*, const Species*>, long long>::const_iterator
+         it = o.infected.begin(); it != o.infected.end(); ++it)
+        infected[it->first] += it->second;
+    steps += o.steps;
+    step_seconds += o.step_seconds;
+    if (o.steps > 0)
+        last_step = o.last_step;
+}
+
+long long Metrics::executed(creature_behavior h) const {
+    return instructions[h];
+}
+
+long long Metrics::actions_taken() const {
+    return actions;
+}
+
+double Metrics::control_per_action() const {
+    if (actions == 0)
+        return 0;
+    const long long control = instructions[if_empty] + instructions[if_wall] +
+                              instructions[if_random] + instructions[if_enemy] +
+                              instructions[go];
+    return static_cast<double>(control) / actions;
+}
+
+long long Metrics::moves() const {
+    return moved;
+}
+
+long long Metrics::blocked_moves() const {
+    return blocked;
+}
+
+long long Metrics::infections(const Species* from, const Species* to) const {
+    std::map<std::pair<const Species*, const Species*>, long long>::const_iterator
+        it = infected.find(std::make_pair(from, to));
+    return it == infected.end() ? 0 : it->second;
+}
+
+long long Metrics::infections() const {
+    long long total = 0;
+    for (std::map<std::pair<const Species*, const Species*>, long long>::const_iterator
+         it = infected.begin(); it != infected.end(); ++it)
+        total += it->second;
+    return total;
+}
+
+long long Metrics::step_count() const {
+    return steps;
+}
+
+double Metrics::mean_step_seconds() const {
+    return steps == 0 ? 0 : step_seconds / steps;
+}
+
+double Metrics::last_step_seconds() const {
+    return last_step;
+}
+
+/* end Metrics */
+
+/* Random */
+
+/*
+ * Scrambles the bits of x (the splitmix64 finalizer)
+ */
+static uint64_t mix(uint64_t x){
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+bool Random::draw(const int turn, const int id, const int k) const {
+    if (!counter)
+        return rand() % 2; //odd number
+    const uint64_t key =
+        static_cast<uint64_t>(static_cast<uint32_t>(turn)) << 32 |
+        static_cast<uint32_t>(id);
+    const uint64_t x = mix(seed + 0x9e3779b97f4a7c15ULL * (mix(key) + k + 1));
+    return x >> 63;
+}
+
+/* end Random */
+
+/* StepPool */
+
+/* atomic<int>s per row in StepPool::progress, filling a 64-byte line */
+const int progress_stride = 64 / sizeof(std::atomic<int>);
+
+class StepPool {
+    private:
+        std::vector<std::thread> helpers;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable finished;
+        /* the job of the current round, run once by every thread */
+        const std::function<void(int)>* job;
+        /* counts rounds, so a helper knows when a new one starts */
+        uint64_t round;
+        /* helpers still working on the current round */
+        int running;
+        bool stopping;
+
+        /*
+         * Runs one helper thread: waits for a round, runs its job, and
+         * reports back until the pool is destroyed
+         * @param id the helper's number, from 1
+         */
+        void serve(int id){
+            using namespace std;
+            uint64_t seen = 0;
+            for (;;){
+                const function<void(int)>* current;
+                {
+                    unique_lock<mutex> guard(lock);
+                    wake.wait(guard, [&]{ return stopping || round != seen; });
+                    if (stopping)
+                        return;
+                    seen = round;
+                    current = job;
+                }
+                (*current)(id);
+                lock_guard<mutex> guard(lock);
+                if (--running == 0)
+                    finished.notify_one();
+            }
+        }
+
+    public:
+        /*
+         * progress[r * progress_stride] is the number of columns of row r
+         * already stepped; the counters of neighbouring rows sit a cache
+         * line apart, so the threads stepping them do not share one
+         */
+        std::unique_ptr<std::atomic<int>[]> progress;
+
+        /*
+         * Starts the helper threads
+         * @param threads the number of threads stepping, counting the
+         *        caller, at least 2
+         * @param rows the height of the World
+         */
+        StepPool(int threads, int rows) :
+            job(0), round(0), running(0), stopping(false),
+            progress(new std::atomic<int>[rows * progress_stride]) {
+            for (int t = 1; t < threads; t++)
+                helpers.push_back(std::thread(&StepPool::serve, this, t));
+        }
+
+        ~StepPool(){
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (size_t t = 0; t < helpers.size(); t++)
+                helpers[t].join();
+        }
+
+        /*
+         * @return the number of threads stepping, counting the caller
+         */
+        int size() const {
+            return helpers.size() + 1;
+        }
+
+        /*
+         * Runs f(0) on the calling thread and f(1)..f(size() - 1) on the
+         * helpers, returning once all have finished; f must not throw
+         * @param f the job of this round
+         */
+        void run(const std::function<void(int)>& f){
+            using namespace std;
+            {
+                lock_guard<mutex> guard(lock);
+                job = &f;
+                running = helpers.size();
+                round++;
+            }
+            wake.notify_all();
+            f(0);
+            unique_lock<mutex> guard(lock);
+            finished.wait(guard, [&]{ return running == 0; });
+        }
+};
+
+/* end StepPool */
+
 /* World */
 
+const int World::vacant;
+
+World::World(int h, int w) :
+    grid(w * h, vacant), width(w), height(h), turn(0),
+    mode(compiled), threads(1), random_species(false), summary(0),
+    summary_interval(0) {}
+
+World::~World(){}
+
 bool World::free_space(Location i) const{
     return i.within_bounds(width, height) &&
-      grid.find(i) == grid.end();
+      grid[i.index(width)] == vacant;
 }
 
 void World::move(const Location l, const direction d){
     using namespace std;
-    map<Location, int>::iterator it = grid.find(l);
-    assert(it != grid.end());
-    const int index = it->second;
+    const int from = l.index(width);
+    assert(grid[from] != vacant);
     Location intended = l + d;
 
     if (free_space(intended)){
         assert(if_empty(l, d));
         assert(!if_enemy(l, d));
         assert(!if_wall(l, d));
-        grid.erase(it);
-        grid.insert(pair<Location, int>(intended, index));
+        swap(grid[from], grid[intended.index(width)]);
+        DARWIN_COUNT(*this, count_move(true));
+    } else {
+        DARWIN_COUNT(*this, count_move(false));
     }
 }
 
 void World::infect(const Location l, const direction d){
     using namespace std;
     if (if_enemy(l, d)){
-        Creature& caller = zoo[grid.find(l)->second];
-        Creature& target = zoo[grid.find(l + d)->second];
+        Creature& caller = zoo[grid[l.index(width)]];
+        Creature& target = zoo[grid[(l + d).index(width)]];
+        DARWIN_COUNT(*this, count_infection(caller.species(), target.species()));
         caller.infect(target);
     }
 }
 
-void World::add_creature(Species* s, direction d, Location l){
+void World::reserve(size_t n){
+    zoo.reserve(n);
+}
+
+void World::note_species(Species* s){
+    using namespace std;
+    random_species = random_species || s->draws_random();
+    if (find(species_seen.begin(), species_seen.end(), s) ==
+        species_seen.end())
+        species_seen.push_back(s);
+}
+
+bool World::add_creature(Species* s, direction d, Location l){
     using namespace std;
     if (!l.within_bounds(width, height)){
         throw out_of_range("Location is out of bounds"); 
@@ -206,39 +792,76 @@ void World::add_creature(Species* s, direction d, Location l){
     if (!s->ready()){
         throw invalid_argument("Species behavior not completed.");
     }
-    if (grid.count(l) == 0){
-        Creature c(s, d);
-        grid.insert(pair<Location, int>(l, zoo.size()));
-        zoo.push_back(c);
+    int& cell = grid[l.index(width)];
+    if (cell == vacant){
+        note_species(s);
+        cell = zoo.size();
+        zoo.push_back(Creature(s, d));
+        return true;
     }
+    return false;
 }
 
 const char empty_space = '.';
 
-void World::print(std::ostream& o) const {
+/*
+ * Formats a board the way World::print shows it into a buffer
+ * @param out replaced with the formatted board
+ * @param turn the turn to show
+ * @param height the number of rows
+ * @param width the number of columns
+ * @param row_cells writes the width characters of a row to a pointer
+ */
+template <typename Row>
+static void format_board(std::string& out, int turn, int height, int width,
+                         Row row_cells){
     using namespace std;
-    o << "Turn = " << turn << "." << endl;
+    const string title = "Turn = " + to_string(turn) + ".\n";
+    const size_t line = width + 3; // heading, space, squares, newline
+    out.resize(title.size() + line * (height + 1) + 1);
+    char* p = &out[0];
+    p = copy(title.begin(), title.end(), p);
     // column heading
-    o << "  ";
+    *p++ = ' ';
+    *p++ = ' ';
     for (int c = 0; c < width; c++){
-        o << c % 10;
+        *p++ = '0' + c % 10;
     }
-    o << endl;
+    *p++ = '\n';
     // rows
     for (int r = 0; r < height; r++){
-        o << r % 10 << " "; //row heading
-        for (int c = 0; c < width; c++){
-            Location current(r, c);
-            map<Location, int>::const_iterator it = grid.find(current);
-            if (it == grid.end()){
-                o << empty_space;
-            } else {
-                zoo[it->second].print(o);
-            }
-        }
-        o << endl;
+        *p++ = '0' + r % 10; //row heading
+        *p++ = ' ';
+        row_cells(r, p);
+        p += width;
+        *p++ = '\n';
+    }
+    *p++ = '\n';
+    assert(p == &out[0] + out.size());
+}
+
+void World::render_cells(std::string& cells) const {
+    cells.resize(grid.size());
+    for (size_t i = 0; i < grid.size(); i++){
+        cells[i] = grid[i] == vacant ?
+            empty_space : zoo[grid[i]].species()->short_name();
     }
-    o << endl;
+}
+
+void World::render(std::string& frame) const {
+    format_board(frame, turn, height, width, [this](int r, char* p){
+        const int* cell = &grid[r * width];
+        for (int c = 0; c < width; c++, cell++){
+            p[c] = *cell == vacant ?
+                empty_space : zoo[*cell].species()->short_name();
+        }
+    });
+}
+
+void World::print(std::ostream& o) const {
+    std::string frame;
+    render(frame);
+    o.write(frame.data(), frame.size());
 }
 
 bool World::if_empty(Location l, direction d) const {
@@ -253,29 +876,1324 @@ bool World::if_wall(Location l, direction d) const {
 bool World::if_enemy(Location l, direction d) const {
     using namespace std;
     Location other = l + d;
-    const Creature& caller = zoo[grid.at(l)];
-    map<Location, int>::const_iterator it = grid.find(other);
-    if (it == grid.end())
+    const int here = grid.at(l.index(width));
+    assert(here != vacant);
+    if (!other.within_bounds(width, height))
+        return false;
+    const int there = grid[other.index(width)];
+    if (there == vacant)
         return false;
     else
-        return !(caller == zoo[it->second]);
+        return !(zoo[here] == zoo[there]);
 }
 
-void World::step(){
+sight World::look(Location l, direction d) const {
+    Location other = l + d;
+    if (!other.within_bounds(width, height))
+        return sees_wall;
+    const int there = grid[other.index(width)];
+    if (there == vacant)
+        return sees_empty;
+    else if (zoo[grid[l.index(width)]] == zoo[there])
+        return sees_friend;
+    else
+        return sees_enemy;
+}
+
+bool World::if_random(Location l, int k) const {
+    return rng.draw(turn, grid[l.index(width)], k);
+}
+
+void World::set_random(const Random& r){
+    rng = r;
+}
+
+void World::set_dispatch(dispatch m){
+    mode = m;
+}
+
+bool World::interpreting() const {
+    return mode == interpreted;
+}
+
+void World::clear(){
     using namespace std;
+    zoo.clear();
+    fill(grid.begin(), grid.end(), vacant);
+    turn = 0;
+    random_species = false;
+    species_seen.clear();
+}
+
+void World::census(const std::vector<Species*>& s,
+                   std::vector<int>& counts) const {
+    counts.assign(s.size(), 0);
+    for (size_t i = 0; i < zoo.size(); i++){
+        const Species* const behavior = zoo[i].species();
+        for (size_t j = 0; j < s.size(); j++){
+            if (s[j] == behavior){
+                counts[j]++;
+                break;
+            }
+        }
+    }
+}
+
+void World::set_threads(int n){
+    if (n < 1){
+        throw std::invalid_argument("A World needs at least one thread.");
+    }
+    threads = n;
+    const int workers = std::min(threads, height);
+    if (workers < 2){
+        pool.reset();
+    } else if (!pool || pool->size() != workers){
+        pool.reset();
+        pool.reset(new StepPool(workers, height));
+    }
+}
+
+void World::step_cells(const int r, const int begin, const int end){
+    using namespace std;
+    vector<int>::const_iterator cell = grid.begin() + r * width + begin;
+    for (int c = begin; c < end; c++, cell++){
+        if (*cell != vacant){
+            Creature& current = zoo[*cell];
+            if (!current.has_taken_turns(turn))
+                current.take_turn(*this, Location(r, c));
+            assert(current.has_taken_turns(turn));
+        }
+    }
+}
+
+#ifdef DARWIN_METRICS
+/* the counters of the calling thread during World::step_wavefront */
+static thread_local Metrics* worker_metrics = 0;
+#endif
+
+/* columns a row steps between publishing its progress */
+const int wavefront_chunk = 32;
+
+void World::step_wavefront(){
+    using namespace std;
+    const int workers = pool->size();
+    atomic<int>* const progress = pool->progress.get();
+    for (int r = 0; r < height; r++)
+        progress[r * progress_stride].store(0, memory_order_relaxed);
+    atomic<bool> failed(false);
+    exception_ptr error;
+    mutex error_lock;
+
+    const function<void(int)> work = [&](const int first){
+#ifdef DARWIN_METRICS
+        Metrics local;
+        worker_metrics = &local;
+#endif
+        try {
+            for (int r = first; r < height; r += workers){
+                int c = 0;
+                while (c < width){
+                    int limit = width;
+                    if (r > 0){
+                        // (r, c) touches (r - 1, c), which (r - 1, c + 1)
+                        // may still change
+                        const int above =
+                            progress[(r - 1) * progress_stride].load(
+                                memory_order_acquire);
+                        if (above < width)
+                            limit = above - 1;
+                    }
+                    if (limit <= c){
+                        if (failed.load(memory_order_relaxed))
+                            break;
+                        this_thread::yield();
+                        continue;
+                    }
+                    const int end = min(limit, c + wavefront_chunk);
+                    step_cells(r, c, end);
+                    progress[r * progress_stride].store(
+                        end, memory_order_release);
+                    c = end;
+                }
+                if (failed.load(memory_order_relaxed))
+                    break;
+            }
+        } catch (...) {
+            lock_guard<mutex> guard(error_lock);
+            if (!error)
+                error = current_exception();
+            failed.store(true);
+        }
+#ifdef DARWIN_METRICS
+        worker_metrics = 0;
+        lock_guard<mutex> guard(error_lock);
+        stats.merge(local);
+#endif
+    };
+
+    pool->run(work);
+    if (error)
+        rethrow_exception(error);
+}
+
+void World::step(){
+#ifdef DARWIN_METRICS
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+#endif
     turn++;
-    for (int r = 0; r < height; r++){
-        for (int c = 0; c < width; c++){
-            Location here(r, c);
-            map<Location, int>::iterator it = grid.find(here);
-            if (it != grid.end()){
-                Creature& current = zoo[it->second];
-                if (!current.has_taken_turns(turn))
-                    current.take_turn(*this, here);
-                assert(current.has_taken_turns(turn));
+    if (pool && !(random_species && rng.shared())){
+        step_wavefront();
+    } else {
+        for (int r = 0; r < height; r++)
+            step_cells(r, 0, width);
+    }
+#ifdef DARWIN_METRICS
+    stats.count_step(std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count());
+#endif
+    if (summary != 0 && turn % summary_interval == 0)
+        summarize(*summary);
+}
+
+Metrics& World::tally(){
+#ifdef DARWIN_METRICS
+    if (worker_metrics != 0)
+        return *worker_metrics;
+#endif
+    return stats;
+}
+
+const Metrics& World::metrics() const {
+    return stats;
+}
+
+void World::reset_metrics(){
+    stats = Metrics();
+}
+
+std::vector<std::pair<Species*, int> > World::population() const {
+    using namespace std;
+    vector<int> counts;
+    census(species_seen, counts);
+    vector<pair<Species*, int> > result;
+    for (size_t i = 0; i < species_seen.size(); i++)
+        result.push_back(make_pair(species_seen[i], counts[i]));
+    return result;
+}
+
+void World::summarize(std::ostream& o) const {
+    using namespace std;
+    ostringstream line;
+    line << "turn=" << turn;
+    const vector<pair<Species*, int> > counts = population();
+    // without metrics the counters were never collected
+    if (Metrics::enabled()){
+        line << " step_ms=" << stats.last_step_seconds() * 1e3
+             << " mean_step_ms=" << stats.mean_step_seconds() * 1e3
+             << " actions=" << stats.actions_taken()
+             << " control_per_action=" << stats.control_per_action()
+             << " moves=" << stats.moves()
+             << " blocked=" << stats.blocked_moves()
+             << " infections=" << stats.infections();
+        for (size_t i = 0; i < counts.size(); i++){
+            for (size_t j = 0; j < counts.size(); j++){
+                const long long n =
+                    stats.infections(counts[i].first, counts[j].first);
+                if (n > 0){
+                    line << " " << counts[i].first->short_name() << ">"
+                         << counts[j].first->short_name() << "=" << n;
+                }
             }
         }
     }
+    line << " population";
+    for (size_t i = 0; i < counts.size(); i++)
+        line << " " << counts[i].first->short_name() << "=" << counts[i].second;
+    line << "\n";
+    const string text = line.str();
+    o.write(text.data(), text.size());
+}
+
+void World::summarize_every(std::ostream& o, int n){
+    summary = n > 0 ? &o : 0;
+    summary_interval = n;
+}
+
+/* snapshot layout; see World::snapshot */
+
+const char snapshot_magic[] = {'D', 'S', 'N', 'P'};
+const uint32_t snapshot_version = 3;
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t height;
+    int32_t width;
+    int32_t turn;
+    int32_t creatures;
+    int32_t species;
+    int32_t seen;
+    uint32_t counter;
+    uint64_t seed;
+};
+
+/* followed by one record per registry entry, to tell species apart */
+
+struct SpeciesRecord {
+    uint32_t program;
+    int32_t name;
+    uint64_t hash;
+};
+
+/* then one int32_t per species the World has held: its registry index,
+   in the order the species was first added */
+
+struct CreatureRecord {
+    int32_t species;
+    int32_t pc;
+    int32_t facing;
+    int32_t turns;
+};
+
+/* followed by one int32_t per square: the index of its creature or -1 */
+
+static_assert(sizeof(int) == sizeof(int32_t),
+              "grid squares are copied as 32-bit records");
+
+/*
+ * Identifies a species by its short name and program
+ * @param s a species
+ * @return the record snapshot writes for s
+ */
+static SpeciesRecord species_record(const Species& s){
+    SpeciesRecord record;
+    memset(&record, 0, sizeof record);
+    record.program = s.program_size();
+    record.name = s.short_name();
+    record.hash = s.program_hash();
+    return record;
+}
+
+void World::snapshot(std::string& buffer,
+                     const std::vector<Species*>& registry) const {
+    using namespace std;
+    const size_t size = sizeof(SnapshotHeader) +
+                        registry.size() * sizeof(SpeciesRecord) +
+                        species_seen.size() * sizeof(int32_t) +
+                        zoo.size() * sizeof(CreatureRecord) +
+                        grid.size() * sizeof(int32_t);
+    buffer.resize(size);
+    char* p = &buffer[0];
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof header);
+    copy(snapshot_magic, snapshot_magic + 4, header.magic);
+    header.version = snapshot_version;
+    header.height = height;
+    header.width = width;
+    header.turn = turn;
+    header.creatures = zoo.size();
+    header.species = registry.size();
+    header.seen = species_seen.size();
+    header.counter = rng.counter;
+    header.seed = rng.seed;
+    memcpy(p, &header, sizeof header);
+    p += sizeof header;
+
+    // position[k] is the registry index of the Species with id k, or -1
+    vector<int32_t> position;
+    for (size_t i = 0; i < registry.size(); i++){
+        const SpeciesRecord record = species_record(*registry[i]);
+        memcpy(p, &record, sizeof record);
+        p += sizeof record;
+        const uint16_t k = registry[i]->id;
+        if (k >= position.size())
+            position.resize(k + 1, -1);
+        if (position[k] < 0)
+            position[k] = i;
+    }
+
+    for (size_t i = 0; i < species_seen.size(); i++){
+        const uint16_t k = species_seen[i]->id;
+        if (k >= position.size() || position[k] < 0){
+            throw invalid_argument("Species missing from the registry.");
+        }
+        memcpy(p, &position[k], sizeof(int32_t));
+        p += sizeof(int32_t);
+    }
+
+    for (size_t i = 0; i < zoo.size(); i++){
+        const Creature& c = zoo[i];
+        if (c.kind >= position.size() || position[c.kind] < 0){
+            throw invalid_argument("Species missing from the registry.");
+        }
+        CreatureRecord record = {position[c.kind], c.pc, c.facing, c.turns};
+        memcpy(p, &record, sizeof record);
+        p += sizeof record;
+    }
+
+    memcpy(p, grid.data(), grid.size() * sizeof(int32_t));
+    assert(p + grid.size() * sizeof(int32_t) == &buffer[0] + size);
+}
+
+void World::restore(const char* data, size_t size,
+                    const std::vector<Species*>& registry){
+    using namespace std;
+    SnapshotHeader header;
+    if (size < sizeof header){
+        throw invalid_argument("Not a World snapshot.");
+    }
+    memcpy(&header, data, sizeof header);
+    if (!equal(snapshot_magic, snapshot_magic + 4, header.magic) ||
+        header.version != snapshot_version){
+        throw invalid_argument("Not a World snapshot.");
+    }
+    if (header.height != height || header.width != width){
+        throw invalid_argument("Snapshot of a World of another size.");
+    }
+    if (header.species != static_cast<int32_t>(registry.size()) ||
+        header.creatures < 0 || header.seen < 0 ||
+        header.seen > header.species ||
+        size != sizeof header + header.species * sizeof(SpeciesRecord) +
+                header.seen * sizeof(int32_t) +
+                header.creatures * sizeof(CreatureRecord) +
+                grid.size() * sizeof(int32_t)){
+        throw invalid_argument("Snapshot does not match the registry.");
+    }
+    if (header.turn < 0){
+        throw invalid_argument("Corrupt World snapshot.");
+    }
+    const char* p = data + sizeof header;
+
+    for (size_t i = 0; i < registry.size(); i++){
+        SpeciesRecord record;
+        memcpy(&record, p, sizeof record);
+        p += sizeof record;
+        if (!registry[i]->ready()){
+            throw invalid_argument("Snapshot does not match the registry.");
+        }
+        const SpeciesRecord expected = species_record(*registry[i]);
+        if (record.program != expected.program ||
+            record.name != expected.name || record.hash != expected.hash){
+            throw invalid_argument("Snapshot does not match the registry.");
+        }
+    }
+
+    zoo.clear();
+    zoo.reserve(header.creatures);
+    random_species = false;
+    species_seen.clear();
+    // seen[i]: whether registry[i] is in species_seen
+    vector<bool> seen(registry.size(), false);
+    for (int i = 0; i < header.seen; i++){
+        int32_t index;
+        memcpy(&index, p, sizeof index);
+        p += sizeof index;
+        if (index < 0 || index >= header.species || seen[index]){
+            clear();
+            throw invalid_argument("Corrupt World snapshot.");
+        }
+        seen[index] = true;
+        note_species(registry[index]);
+    }
+    for (int i = 0; i < header.creatures; i++){
+        CreatureRecord record;
+        memcpy(&record, p, sizeof record);
+        p += sizeof record;
+        if (record.species < 0 || record.species >= header.species ||
+            record.facing < west || record.facing > south ||
+            // a program that ends in an action leaves pc at its end
+            record.pc < 0 ||
+            record.pc > registry[record.species]->program_size() ||
+            record.turns < 0 || record.turns > header.turn ||
+            !seen[record.species]){
+            clear();
+            throw invalid_argument("Corrupt World snapshot.");
+        }
+        Species* const s = registry[record.species];
+        Creature c(s, static_cast<direction>(record.facing));
+        c.pc = record.pc;
+        c.turns = record.turns;
+        zoo.push_back(c);
+    }
+
+    memcpy(grid.data(), p, grid.size() * sizeof(int32_t));
+    // every creature must stand on exactly one square
+    vector<bool> placed(header.creatures, false);
+    int placed_count = 0;
+    for (size_t i = 0; i < grid.size(); i++){
+        if (grid[i] == vacant)
+            continue;
+        if (grid[i] < 0 || grid[i] >= header.creatures || placed[grid[i]]){
+            clear();
+            throw invalid_argument("Corrupt World snapshot.");
+        }
+        placed[grid[i]] = true;
+        placed_count++;
+    }
+    if (placed_count != header.creatures){
+        clear();
+        throw invalid_argument("Corrupt World snapshot.");
+    }
+    turn = header.turn;
+    rng = header.counter ? Random(header.seed) : Random();
+}
+
+void World::save(const std::string& path,
+                 const std::vector<Species*>& registry) const {
+    using namespace std;
+    string buffer;
+    snapshot(buffer, registry);
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    if (!out.write(buffer.data(), buffer.size()) || !out.flush()){
+        throw runtime_error("Cannot write snapshot " + path);
+    }
+}
+
+void World::load(const std::string& path,
+                 const std::vector<Species*>& registry){
+    using namespace std;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0){
+        throw runtime_error("Cannot open snapshot " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0){
+        close(fd);
+        throw runtime_error("Cannot read snapshot " + path);
+    }
+    void* const data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        throw runtime_error("Cannot map snapshot " + path);
+    }
+    try {
+        restore(static_cast<const char*>(data), info.st_size, registry);
+    } catch (...) {
+        munmap(data, info.st_size);
+        throw;
+    }
+    munmap(data, info.st_size);
 }
 
 /* end World */
+
+/* Scenario */
+
+/*
+ * Advances a splitmix64 stream
+ * @param state the stream's state
+ * @return the next value of the stream
+ */
+static uint64_t next_seeded(uint64_t& state){
+    state += 0x9e3779b97f4a7c15ULL;
+    return mix(state);
+}
+
+Scenario::Scenario(int h, int w, int t) :
+        height(h), width(w), turns(t), interval(1) {
+    if (h <= 0 || w <= 0 || t < 0){
+        throw std::invalid_argument("Invalid Scenario size.");
+    }
+}
+
+void Scenario::add_species(Species* s, int n){
+    if (s == 0 || !s->ready()){
+        throw std::invalid_argument("Species behavior not completed.");
+    }
+    species.push_back(s);
+    counts.push_back(n);
+}
+
+void Scenario::sample_every(int n){
+    if (n <= 0){
+        throw std::invalid_argument("Sampling interval must be positive.");
+    }
+    interval = n;
+}
+
+void Scenario::populate(World& w, uint64_t seed) const {
+    w.set_random(Random(seed));
+    uint64_t state = seed;
+    const uint64_t cells = static_cast<uint64_t>(height) * width;
+    for (size_t i = 0; i < species.size(); i++){
+        for (int j = 0; j < counts[i]; j++){
+            const int position = next_seeded(state) % cells;
+            const direction d = static_cast<direction>(next_seeded(state) % 4);
+            w.add_creature(species[i], d,
+                           Location(position / width, position % width));
+        }
+    }
+}
+
+/* end Scenario */
+
+/* Ensemble */
+
+Ensemble::Ensemble(const Scenario& s) :
+        scenario(s), runs(0),
+        population((s.turns / s.interval + 1) * s.species.size(), 0),
+        wins(s.species.size(), 0),
+        extinctions(s.species.size(), 0),
+        extinction_turns(s.species.size(), 0) {}
+
+void Ensemble::merge(const Ensemble& o){
+    runs += o.runs;
+    for (size_t i = 0; i < population.size(); i++)
+        population[i] += o.population[i];
+    for (size_t i = 0; i < wins.size(); i++){
+        wins[i] += o.wins[i];
+        extinctions[i] += o.extinctions[i];
+        extinction_turns[i] += o.extinction_turns[i];
+    }
+}
+
+void Ensemble::run_one(World& w, uint64_t seed){
+    using namespace std;
+    const int n = scenario.species.size();
+    const int samples = scenario.turns / scenario.interval + 1;
+    w.clear();
+    scenario.populate(w, seed);
+
+    vector<int> counts;
+    vector<bool> extinct(n, false);
+    int alive = 0;
+    for (int t = 0; ; t++){
+        if (t > 0)
+            w.step();
+        w.census(scenario.species, counts);
+        alive = 0;
+        for (int i = 0; i < n; i++){
+            if (counts[i] > 0){
+                alive++;
+            } else if (!extinct[i]){
+                extinct[i] = true;
+                extinctions[i]++;
+                extinction_turns[i] += t;
+            }
+        }
+        if (alive <= 1){
+            // populations can no longer change
+            for (int sample = (t + scenario.interval - 1) / scenario.interval;
+                 sample < samples; sample++)
+                for (int i = 0; i < n; i++)
+                    population[sample * n + i] += counts[i];
+            break;
+        }
+        if (t % scenario.interval == 0){
+            const int sample = t / scenario.interval;
+            for (int i = 0; i < n; i++)
+                population[sample * n + i] += counts[i];
+        }
+        if (t == scenario.turns)
+            break;
+    }
+    if (alive == 1){
+        for (int i = 0; i < n; i++)
+            if (counts[i] > 0)
+                wins[i]++;
+    }
+    runs++;
+}
+
+/* A range of seeds owned by one worker of Ensemble::run */
+struct SeedRange {
+    std::mutex lock;
+    uint64_t next;
+    uint64_t end;
+};
+
+/*
+ * Takes a seed from a worker's own range, or steals the upper half of
+ * another worker's range when its own is empty
+ * @param ranges the ranges of all workers
+ * @param workers the number of workers
+ * @param self the index of the calling worker
+ * @param seed set to the seed taken
+ * @return false when no seeds are left
+ */
+static bool take_seed(SeedRange* ranges, int workers, int self,
+                      uint64_t& seed){
+    using namespace std;
+    {
+        lock_guard<mutex> guard(ranges[self].lock);
+        if (ranges[self].next < ranges[self].end){
+            seed = ranges[self].next++;
+            return true;
+        }
+    }
+    for (int k = 1; k < workers; k++){
+        SeedRange& victim = ranges[(self + k) % workers];
+        uint64_t first;
+        uint64_t last;
+        {
+            lock_guard<mutex> guard(victim.lock);
+            const uint64_t remaining = victim.end - victim.next;
+            if (remaining == 0)
+                continue;
+            first = victim.end - (remaining + 1) / 2;
+            last = victim.end;
+            victim.end = first;
+        }
+        lock_guard<mutex> guard(ranges[self].lock);
+        seed = first;
+        ranges[self].next = first + 1;
+        ranges[self].end = last;
+        return true;
+    }
+    return false;
+}
+
+void Ensemble::run(uint64_t first, uint64_t last, int threads){
+    using namespace std;
+    if (threads < 1){
+        throw invalid_argument("An Ensemble needs at least one thread.");
+    }
+    if (last <= first)
+        return;
+    const uint64_t total = last - first;
+    unique_ptr<SeedRange[]> ranges(new SeedRange[threads]);
+    for (int t = 0; t < threads; t++){
+        ranges[t].next = first + total * t / threads;
+        ranges[t].end = first + total * (t + 1) / threads;
+    }
+    vector<Ensemble> partial(threads, Ensemble(scenario));
+    exception_ptr error;
+    mutex error_lock;
+
+    auto work = [&](const int self){
+        try {
+            World w(scenario.height, scenario.width);
+            uint64_t seed;
+            while (take_seed(ranges.get(), threads, self, seed))
+                partial[self].run_one(w, seed);
+        } catch (...) {
+            lock_guard<mutex> guard(error_lock);
+            if (!error)
+                error = current_exception();
+        }
+    };
+
+    vector<thread> pool;
+    for (int t = 1; t < threads; t++)
+        pool.push_back(thread(work, t));
+    work(0);
+    for (size_t t = 0; t < pool.size(); t++)
+        pool[t].join();
+    if (error)
+        rethrow_exception(error);
+    for (int t = 0; t < threads; t++)
+        merge(partial[t]);
+}
+
+long long Ensemble::size() const {
+    return runs;
+}
+
+double Ensemble::mean_population(int i, int sample) const {
+    const int n = scenario.species.size();
+    return runs == 0 ? 0 :
+        static_cast<double>(population.at(sample * n + i)) / runs;
+}
+
+double Ensemble::win_rate(int i) const {
+    return runs == 0 ? 0 : static_cast<double>(wins.at(i)) / runs;
+}
+
+double Ensemble::extinction_rate(int i) const {
+    return runs == 0 ? 0 : static_cast<double>(extinctions.at(i)) / runs;
+}
+
+double Ensemble::mean_extinction_turn(int i) const {
+    if (extinctions.at(i) == 0)
+        return -1;
+    return static_cast<double>(extinction_turns[i]) / extinctions[i];
+}
+
+void Ensemble::print(std::ostream& o) const {
+    using namespace std;
+    const int n = scenario.species.size();
+    const int samples = scenario.turns / scenario.interval + 1;
+    o << "runs\t" << runs << "\n\n";
+    o << "species\twin_rate\textinction_rate\tmean_extinction_turn\n";
+    for (int i = 0; i < n; i++){
+        scenario.species[i]->print_short_name(o);
+        o << "\t" << win_rate(i) << "\t" << extinction_rate(i)
+          << "\t" << mean_extinction_turn(i) << "\n";
+    }
+    o << "\nturn";
+    for (int i = 0; i < n; i++){
+        o << "\t";
+        scenario.species[i]->print_short_name(o);
+    }
+    o << "\n";
+    for (int sample = 0; sample < samples; sample++){
+        o << sample * scenario.interval;
+        for (int i = 0; i < n; i++)
+            o << "\t" << mean_population(i, sample);
+        o << "\n";
+    }
+}
+
+/* end Ensemble */
+
+/* TraceWriter / TraceReader */
+
+const char trace_magic[] = {'D', 'T', 'R', 'C'};
+const unsigned trace_version = 1;
+
+/* equal squares a run absorbs rather than starting a new run */
+const size_t trace_gap = 3;
+
+/* the most squares a traced board may have, so a header cannot ask a
+   reader for an unbounded frame */
+const uint64_t trace_max_cells = 1 << 28;
+
+/*
+ * Appends an unsigned LEB128 varint to a buffer
+ */
+static void put_varint(std::string& out, uint64_t v){
+    while (v >= 0x80){
+        out += static_cast<char>(v | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+/*
+ * Reads an unsigned LEB128 varint from a stream
+ * @param v set to the value read
+ * @return false at end of stream before the first byte
+ * @throw invalid_argument when the stream ends inside the varint
+ */
+static bool get_varint(std::istream& in, uint64_t& v){
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+        const int b = in.get();
+        if (b == std::char_traits<char>::eof()){
+            if (shift == 0)
+                return false;
+            throw std::invalid_argument("Truncated trace.");
+        }
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    throw std::invalid_argument("Corrupt trace.");
+}
+
+void TraceWriter::write(const World& w){
+    using namespace std;
+    buffer.clear();
+    if (!started){
+        if (static_cast<uint64_t>(w.height) * w.width > trace_max_cells)
+            throw invalid_argument("World is too large to trace.");
+        started = true;
+        height = w.height;
+        width = w.width;
+        buffer.append(trace_magic, sizeof trace_magic);
+        put_varint(buffer, trace_version);
+        put_varint(buffer, height);
+        put_varint(buffer, width);
+        previous.assign(static_cast<size_t>(height) * width, empty_space);
+    } else if (w.height != height || w.width != width){
+        throw invalid_argument("World does not match the trace size.");
+    }
+    w.render_cells(cells);
+    put_varint(buffer, w.turn);
+
+    // find the runs first, since their count leads the frame
+    vector<pair<size_t, size_t> > runs;
+    const size_t size = cells.size();
+    size_t i = 0;
+    while (i < size){
+        if (cells[i] == previous[i]){
+            i++;
+            continue;
+        }
+        const size_t begin = i;
+        size_t end = i + 1;
+        while (end < size){
+            if (cells[end] != previous[end]){
+                end++;
+                continue;
+            }
+            size_t same = end;
+            while (same < size && same - end < trace_gap &&
+                   cells[same] == previous[same])
+                same++;
+            if (same < size && same - end < trace_gap)
+                end = same;
+            else
+                break;
+        }
+        runs.push_back(make_pair(begin, end));
+        i = end;
+    }
+
+    put_varint(buffer, runs.size());
+    size_t last = 0;
+    for (size_t r = 0; r < runs.size(); r++){
+        put_varint(buffer, runs[r].first - last);
+        put_varint(buffer, runs[r].second - runs[r].first);
+        buffer.append(cells, runs[r].first, runs[r].second - runs[r].first);
+        last = runs[r].second;
+    }
+    out.write(buffer.data(), buffer.size());
+    previous.swap(cells);
+}
+
+TraceReader::TraceReader(std::istream& i) :
+        in(i), height(0), width(0), turn(0) {
+    using namespace std;
+    char magic[sizeof trace_magic];
+    uint64_t version;
+    uint64_t h;
+    uint64_t w;
+    if (!in.read(magic, sizeof magic) ||
+        !equal(magic, magic + sizeof magic, trace_magic) ||
+        !get_varint(in, version) || version != trace_version ||
+        !get_varint(in, h) || !get_varint(in, w)){
+        throw invalid_argument("Not a Darwin trace.");
+    }
+    if (h > trace_max_cells || w > trace_max_cells ||
+        h * w > trace_max_cells){
+        throw invalid_argument("Trace board is too large.");
+    }
+    height = static_cast<int>(h);
+    width = static_cast<int>(w);
+    cells.assign(h * w, empty_space);
+}
+
+bool TraceReader::next(){
+    using namespace std;
+    uint64_t t;
+    if (!get_varint(in, t))
+        return false;
+    uint64_t runs;
+    if (!get_varint(in, runs))
+        throw invalid_argument("Truncated trace.");
+    size_t at = 0;
+    for (uint64_t r = 0; r < runs; r++){
+        uint64_t skip;
+        uint64_t length;
+        if (!get_varint(in, skip) || !get_varint(in, length))
+            throw invalid_argument("Truncated trace.");
+        // compare before adding, so a huge skip cannot wrap around
+        if (skip > cells.size() - at)
+            throw invalid_argument("Corrupt trace.");
+        at += skip;
+        if (length > cells.size() - at)
+            throw invalid_argument("Corrupt trace.");
+        if (!in.read(&cells[at], length))
+            throw invalid_argument("Truncated trace.");
+        at += length;
+    }
+    turn = t;
+    return true;
+}
+
+void TraceReader::print(std::ostream& o){
+    format_board(buffer, turn, height, width, [this](int r, char* p){
+        std::copy(cells.begin() + r * width,
+                  cells.begin() + (r + 1) * width, p);
+    });
+    o.write(buffer.data(), buffer.size());
+}
+
+/* end TraceWriter / TraceReader */
+
+/* ScenarioFile */
+
+/* A line of a scenario file, read one token at a time */
+struct ScenarioLine {
+    const char* p;
+    const char* end;
+    int number;
+
+    /*
+     * @param t set to the next whitespace-separated token
+     * @return false when the line has no more tokens
+     */
+    bool token(std::string& t){
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        const char* const begin = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+            p++;
+        t.assign(begin, p);
+        return begin != p;
+    }
+
+    /*
+     * @return an exception naming this line
+     */
+    std::invalid_argument error(const std::string& what) const {
+        return std::invalid_argument(
+            "line " + std::to_string(number) + ": " + what);
+    }
+
+    /*
+     * Reads a non-negative integer token
+     * @param what the name of the value, for errors
+     * @throw invalid_argument when the token is missing or not a number
+     */
+    long long number_token(const char* what){
+        std::string t;
+        if (!token(t))
+            throw error(std::string("missing ") + what);
+        long long n = 0;
+        for (size_t i = 0; i < t.size(); i++){
+            if (t[i] < '0' || t[i] > '9' || n > (1LL << 40))
+                throw error(std::string("bad ") + what + " '" + t + "'");
+            n = n * 10 + (t[i] - '0');
+        }
+        return n;
+    }
+
+    /*
+     * @throw invalid_argument when the line has tokens left
+     */
+    void finish(){
+        std::string t;
+        if (token(t))
+            throw error("unexpected '" + t + "'");
+    }
+};
+
+/*
+ * Splits a buffer into lines, dropping comments
+ */
+class ScenarioReader {
+    private:
+        const char* p;
+        const char* const end;
+        int number;
+
+    public:
+        ScenarioReader(const char* data, size_t size) :
+            p(data), end(data + size), number(0) {}
+
+        /*
+         * @param line set to the next line
+         * @return false at the end of the buffer
+         */
+        bool next(ScenarioLine& line){
+            if (p >= end)
+                return false;
+            const char* eol = static_cast<const char*>(
+                memchr(p, '\n', end - p));
+            if (eol == 0)
+                eol = end;
+            const char* comment = static_cast<const char*>(
+                memchr(p, '#', eol - p));
+            line.p = p;
+            line.end = comment == 0 ? eol : comment;
+            line.number = ++number;
+            p = eol + 1;
+            return true;
+        }
+};
+
+/*
+ * @return the direction named by a token
+ * @throw invalid_argument when the token is not a direction
+ */
+static direction parse_direction(ScenarioLine& line){
+    std::string t;
+    line.token(t);
+    const char* const names[] = {"west", "north", "east", "south"};
+    for (int d = west; d <= south; d++)
+        if (t == names[d])
+            return static_cast<direction>(d);
+    throw line.error("bad direction '" + t + "'");
+}
+
+ScenarioFile::ScenarioFile(const std::string& path){
+    using namespace std;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0){
+        throw runtime_error("Cannot open scenario " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0){
+        close(fd);
+        throw runtime_error("Cannot read scenario " + path);
+    }
+    if (info.st_size == 0){
+        close(fd);
+        parse("", 0);
+        return;
+    }
+    void* const data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        throw runtime_error("Cannot map scenario " + path);
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+    try {
+        parse(static_cast<const char*>(data), info.st_size);
+    } catch (...) {
+        munmap(data, info.st_size);
+        throw;
+    }
+    munmap(data, info.st_size);
+}
+
+ScenarioFile::ScenarioFile(const char* data, size_t size){
+    parse(data, size);
+}
+
+void ScenarioFile::parse(const char* data, size_t size){
+    using namespace std;
+    const char* const instruction_names[] = {"hop", "left", "right", "infect",
+        "if_empty", "if_wall", "if_random", "if_enemy", "go"};
+
+    ScenarioReader reader(data, size);
+    ScenarioLine line;
+    string t;
+    bool seeded = false;
+    uint64_t seed = 0;
+    uint64_t state = 0;
+
+    while (reader.next(line)){
+        if (!line.token(t))
+            continue;
+
+        if (t == "world"){
+            if (loaded)
+                throw line.error("world given twice");
+            const long long rows = line.number_token("rows");
+            const long long columns = line.number_token("columns");
+            line.finish();
+            if (rows <= 0 || columns <= 0 || rows * columns > (1LL << 31) - 1)
+                throw line.error("bad world size");
+            loaded.reset(new World(rows, columns));
+            if (seeded)
+                loaded->set_random(Random(seed));
+
+        } else if (t == "seed"){
+            seed = line.number_token("seed");
+            line.finish();
+            seeded = true;
+            state = seed;
+            if (loaded)
+                loaded->set_random(Random(seed));
+
+        } else if (t == "species"){
+            string name;
+            if (!line.token(name))
+                throw line.error("missing species name");
+            line.finish();
+            if (find(name) != 0)
+                throw line.error("species '" + name + "' given twice");
+            const int species_line = line.number;
+            unique_ptr<Species> s(new Species(name));
+
+            // instructions with their targets, resolved at "end"
+            vector<Instruction> program;
+            vector<string> targets;
+            vector<int> target_lines;
+            map<string, int> labels;
+            bool ended = false;
+            while (!ended && reader.next(line)){
+                while (line.token(t)){
+                    if (t == "end"){
+                        line.finish();
+                        ended = true;
+                        break;
+                    }
+                    if (t[t.size() - 1] == ':'){
+                        const string label = t.substr(0, t.size() - 1);
+                        if (label.empty() ||
+                            !labels.insert(make_pair(label, program.size())).second)
+                            throw line.error("bad label '" + label + "'");
+                        continue;
+                    }
+                    int h = 0;
+                    while (h < behaviors && t != instruction_names[h])
+                        h++;
+                    if (h == behaviors)
+                        throw line.error("unknown instruction '" + t + "'");
+                    string target;
+                    if (h >= if_empty && !line.token(target))
+                        throw line.error("missing target for " + t);
+                    line.finish();
+                    Instruction i = {static_cast<creature_behavior>(h), 0};
+                    program.push_back(i);
+                    targets.push_back(target);
+                    target_lines.push_back(line.number);
+                    break;
+                }
+            }
+            if (!ended)
+                throw line.error("species '" + name + "' has no end");
+            if (program.empty())
+                throw line.error("species '" + name + "' has no instructions");
+
+            for (size_t k = 0; k < program.size(); k++){
+                if (program[k].h < if_empty)
+                    continue;
+                const string& target = targets[k];
+                map<string, int>::const_iterator it = labels.find(target);
+                if (it != labels.end()){
+                    program[k].n = it->second;
+                } else if (target.find_first_not_of("0123456789") ==
+                           string::npos && target.size() < 10){
+                    program[k].n = atoi(target.c_str());
+                } else {
+                    throw invalid_argument("line " +
+                        to_string(target_lines[k]) +
+                        ": unknown label '" + target + "'");
+                }
+                if (program[k].n >= static_cast<int>(program.size())){
+                    throw invalid_argument("line " +
+                        to_string(target_lines[k]) +
+                        ": jump to " + target + " leaves the program");
+                }
+            }
+            // only a go at the end keeps control inside the program
+            if (program.back().h != go){
+                throw invalid_argument("line " +
+                    to_string(target_lines.back()) +
+                    ": program runs past its last instruction");
+            }
+            for (size_t k = 0; k < program.size(); k++)
+                s->add_instruction(program[k]);
+            s->complete();
+            if (!s->total()){
+                throw invalid_argument("line " + to_string(species_line) +
+                    ": species '" + name + "' can loop without acting");
+            }
+            registry.push_back(s.get());
+            names.push_back(name);
+            owned.push_back(move(s));
+
+        } else if (t == "creature" || t == "random" || t == "board"){
+            if (!loaded)
+                throw line.error(t + " before world");
+            World& w = *loaded;
+
+            if (t == "creature"){
+                string name;
+                line.token(name);
+                Species* const s = find(name);
+                if (s == 0)
+                    throw line.error("unknown species '" + name + "'");
+                const direction d = parse_direction(line);
+                const long long r = line.number_token("row");
+                const long long c = line.number_token("column");
+                line.finish();
+                if (r >= w.height || c >= w.width)
+                    throw line.error("square outside the world");
+                if (!w.add_creature(s, d, Location(r, c)))
+                    throw line.error("square already taken");
+
+            } else if (t == "random"){
+                string name;
+                line.token(name);
+                Species* const s = find(name);
+                if (s == 0)
+                    throw line.error("unknown species '" + name + "'");
+                const long long n = line.number_token("count");
+                line.finish();
+                const uint64_t cells = static_cast<uint64_t>(w.height) * w.width;
+                if (n > static_cast<long long>(cells - w.zoo.size()))
+                    throw line.error("not enough empty squares");
+                w.reserve(w.zoo.size() + n);
+                // squares are filled directly, as for board
+                for (long long k = 0; k < n; ){
+                    const uint64_t position = next_seeded(state) % cells;
+                    const direction d =
+                        static_cast<direction>(next_seeded(state) % 4);
+                    int& cell = w.grid[position];
+                    if (cell == World::vacant){
+                        cell = w.zoo.size();
+                        w.zoo.push_back(Creature(s, d));
+                        k++;
+                    }
+                }
+                if (n > 0)
+                    w.note_species(s);
+
+            } else {
+                const direction d = parse_direction(line);
+                line.finish();
+                Species* by_letter[256] = {0};
+                bool ambiguous[256] = {false};
+                bool used[256] = {false};
+                for (size_t k = 0; k < registry.size(); k++){
+                    const unsigned char letter = registry[k]->short_name();
+                    if (by_letter[letter] != 0)
+                        ambiguous[letter] = true;
+                    by_letter[letter] = registry[k];
+                }
+                for (int k = 0; k < 256; k++)
+                    if (ambiguous[k])
+                        by_letter[k] = 0;
+                // a World holds at most one creature per square; pages of
+                // the reservation the board leaves unused are never touched
+                w.reserve(w.grid.size());
+                for (int r = 0; r < w.height; r++){
+                    if (!reader.next(line))
+                        throw line.error("board ends early");
+                    const char* p = line.p;
+                    while (p < line.end && (*p == ' ' || *p == '\t'))
+                        p++;
+                    const char* end = line.end;
+                    while (end > p && (end[-1] == ' ' || end[-1] == '\t' ||
+                                       end[-1] == '\r'))
+                        end--;
+                    if (end - p != w.width)
+                        throw line.error("board row is not " +
+                                         to_string(w.width) + " squares");
+                    // rows are filled directly: the species are ready
+                    // and the squares in bounds
+                    int* cell = &w.grid[r * w.width];
+                    for (int c = 0; c < w.width; c++, p++, cell++){
+                        if (*p == empty_space)
+                            continue;
+                        const unsigned char letter = *p;
+                        Species* const s = by_letter[letter];
+                        if (s == 0)
+                            throw line.error(string("no single species for '") +
+                                             *p + "'");
+                        if (*cell != World::vacant)
+                            throw line.error("square already taken");
+                        *cell = w.zoo.size();
+                        w.zoo.push_back(Creature(s, d));
+                        used[letter] = true;
+                    }
+                }
+                for (size_t k = 0; k < registry.size(); k++)
+                    if (used[static_cast<unsigned char>(
+                            registry[k]->short_name())])
+                        w.note_species(registry[k]);
+            }
+
+        } else {
+            throw line.error("unknown directive '" + t + "'");
+        }
+    }
+
+    if (!loaded)
+        throw invalid_argument("scenario has no world");
+}
+
+World& ScenarioFile::world(){
+    return *loaded;
+}
+
+const std::vector<Species*>& ScenarioFile::species() const {
+    return registry;
+}
+
+Species* ScenarioFile::find(const std::string& name) const {
+    for (size_t i = 0; i < names.size(); i++)
+        if (names[i] == name)
+            return registry[i];
+    return 0;
+}
+
+/* end ScenarioFile */
@@ -2,11 +2,38 @@
 #define Darwin_h
 
 #include <vector>
+#include <istream>
 #include <ostream>
+#include <string>
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <utility>
 
 enum direction {west, north, east, south};
 
+/* What a creature finds in the square it is facing */
+enum sight {sees_empty, sees_wall, sees_enemy, sees_friend};
+
+/* How creatures run their Species' programs */
+enum dispatch {compiled, interpreted};
+
+enum creature_behavior {hop, left, right, infect,
+                        if_empty, if_wall, if_random, if_enemy, go};
+
+/* number of creature_behavior values */
+const int behaviors = go + 1;
+
+/*
+ * Instrumentation hooks. Building every file with -DDARWIN_METRICS makes
+ * World collect Metrics; otherwise the hooks compile to nothing.
+ */
+#ifdef DARWIN_METRICS
+#define DARWIN_COUNT(w, call) ((w).tally().call)
+#else
+#define DARWIN_COUNT(w, call) ((void) 0)
+#endif
+
 class Instruction;
 
 class Species;
@@ -15,13 +42,172 @@ class World;
 
 class Location;
 
+/* Counters a World collects when built with DARWIN_METRICS */
+class Metrics {
+    private:
+        long long instructions[behaviors];
+        long long actions;
+        long long moved;
+        long long blocked;
+        std::map<std::pair<const Species*, const Species*>, long long> infected;
+        long long steps;
+        double step_seconds;
+        double last_step;
+
+    public:
+        Metrics();
+
+        /*
+         * Checks whether the program was built to collect metrics
+         */
+        static bool enabled();
+
+        /*
+         * Counts executed instructions
+         * @param h the kind of instruction
+         * @param n how many were executed
+         */
+        void count_instruction(creature_behavior, long long);
+
+        /*
+         * Counts the turn of one creature
+         */
+        void count_action();
+
+        /*
+         * Counts a hop
+         * @param success whether the creature actually moved
+         */
+        void count_move(bool);
+
+        /*
+         * Counts an infection
+         * @param from the species of the infecting creature
+         * @param to the species the target had
+         */
+        void count_infection(const Species*, const Species*);
+
+        /*
+         * Counts a step of the World
+         * @param seconds the wall time it took
+         */
+        void count_step(double);
+
+        /*
+         * Adds the counters of another Metrics to these
+         * @param o the counters to add
+         */
+        void merge(const Metrics&);
+
+        /*
+         * @param h a kind of instruction
+         * @return how many instructions of that kind were executed
+         */
+        long long executed(creature_behavior) const;
+
+        /*
+         * @return the number of turns creatures have taken
+         */
+        long long actions_taken() const;
+
+        /*
+         * @return the mean number of go and if_* instructions executed
+         *         per turn of a creature
+         */
+        double control_per_action() const;
+
+        /*
+         * @return the number of hops that moved the creature
+         */
+        long long moves() const;
+
+        /*
+         * @return the number of hops blocked by a wall or creature
+         */
+        long long blocked_moves() const;
+
+        /*
+         * @param from the species of the infecting creatures
+         * @param to the species of the infected creatures
+         * @return how many creatures of to were infected by from
+         */
+        long long infections(const Species*, const Species*) const;
+
+        /*
+         * @return the total number of infections
+         */
+        long long infections() const;
+
+        /*
+         * @return the number of steps counted
+         */
+        long long step_count() const;
+
+        /*
+         * @return the mean wall time of a step in seconds
+         */
+        double mean_step_seconds() const;
+
+        /*
+         * @return the wall time of the last step in seconds
+         */
+        double last_step_seconds() const;
+};
+
+/* The source of a World's if_random draws */
+class Random {
+    private:
+        friend class World;
+
+        uint64_t seed;
+        bool counter;
+
+    public:
+        /*
+         * Draws from the global rand(), as seeded by srand
+         */
+        Random() : seed(0), counter(false) {}
+
+        /*
+         * Draws by hashing (seed, turn, creature, draw), so draws do not
+         * depend on the order creatures take their turns in
+         * @param s the seed
+         */
+        explicit Random(uint64_t s) : seed(s), counter(true) {}
+
+        /*
+         * Draws one random bit
+         * @param turn the World's current turn
+         * @param id the index of the drawing creature in the World
+         * @param k how many draws the creature has already made this turn
+         * @return the bit, as rand() % 2 in compatibility mode
+         */
+        bool draw(int, int, int) const;
+
+        /*
+         * Checks whether draws come from the global rand()
+         */
+        bool shared() const {
+            return !counter;
+        }
+};
+
 /* Represents an individual creature */
 class Creature {
     private:
-        Species* behavior;
+        friend class World;
+
         int pc;
-        direction facing;
         int turns;
+        /* the id of the creature's Species, see Species::id */
+        uint16_t kind;
+        /* a direction, kept in one byte */
+        uint8_t facing;
+
+        /*
+         * @return the direction the creature is facing
+         */
+        direction heading() const;
 
         /*
          * Turns the creature counterclockwise in place.
@@ -34,9 +220,16 @@ class Creature {
          */
         void turn_right();
 
+        /*
+         * Runs this creature's program one instruction at a time until it
+         * performs an action. Reference implementation for take_turn.
+         * @param w the World containing this creature
+         * @param l the Location of this creature
+         */
+        void interpret(World&, Location);
+
     public:
-        Creature (Species* s, direction d) :
-            behavior(s), pc(0), facing(d), turns(0) {}
+        Creature (Species* s, direction d);
 
         /*
          * Changes the target creature's species to that of this creature
@@ -62,7 +255,7 @@ class Creature {
          * @return true if they are of the same species, false otherwise
          */
         bool operator ==(const Creature& o) const {
-            return o.behavior == behavior;
+            return o.kind == kind;
         }
 
         /*
@@ -71,6 +264,12 @@ class Creature {
          * @return whether the creature has taken this many turns
          */
         bool has_taken_turns(int) const;
+
+        /*
+         * Gets the species currently driving this creature
+         * @return the creature's Species
+         */
+        const Species* species() const;
 };
 
 class Location {
@@ -99,10 +298,19 @@ class Location {
          * @param h the height of the grid
          * @return true if this location is in [0..w) x [0..h)
          */
-        bool within_bounds(int w, int h){
+        bool within_bounds(int w, int h) const {
             return x >= 0 && x < w && y >= 0 && y < h;
         }
 
+        /*
+         * Computes the position of this location in a row-major grid
+         * @param w the width of the grid
+         * @return y * w + x, the offset of this location in the grid
+         */
+        int index(int w) const {
+            return y * w + x;
+        }
+
         /*
          * Computes a new location relative to the current location
          * @param d the direction relative to this location
@@ -111,13 +319,35 @@ class Location {
         Location operator +(direction d) const;
 };
 
+/* The worker threads and row progress a threaded World::step reuses */
+class StepPool;
+
 class World {
     private:
+        friend class TraceWriter;
+        friend class ScenarioFile;
+
+        /* Marks a grid cell that holds no creature */
+        static const int vacant = -1;
+
         std::vector<Creature> zoo;
-        std::map<Location, int> grid;
+        /* Row-major cells, each holding an index into zoo or vacant */
+        std::vector<int> grid;
         const int width;
         const int height;
         int turn;
+        dispatch mode;
+        int threads;
+        /* the helper threads of step_wavefront, made by set_threads */
+        std::unique_ptr<StepPool> pool;
+        /* Whether any creature's species uses if_random */
+        bool random_species;
+        Random rng;
+        /* every species added, in the order first added */
+        std::vector<Species*> species_seen;
+        Metrics stats;
+        std::ostream* summary;
+        int summary_interval;
 
         /*
          * Checks whether a location is both in the world and unoccupied
@@ -126,8 +356,102 @@ class World {
          */
         bool free_space(Location) const;
 
+        /*
+         * Records that creatures of a species live in this World
+         * @param s the species of a newly added creature
+         */
+        void note_species(Species*);
+
+        /*
+         * Gives a turn to every creature in columns [begin..end) of a row
+         * that has not yet had one this turn
+         * @param r the row to work on
+         * @param begin the first column
+         * @param end one past the last column
+         */
+        void step_cells(int, int, int);
+
+        /*
+         * Steps the rows as a wavefront across worker threads, with
+         * row r at column c waiting until row r - 1 is past column c + 1.
+         * This gives the same result as stepping in row-major order.
+         */
+        void step_wavefront();
+
     public:
-        World(int h, int w) : width(w), height(h), turn(0) {}
+        World(int h, int w);
+
+        ~World();
+
+        /*
+         * Selects how creatures execute their programs; interpreted mode
+         * walks every instruction and is kept for checking compiled mode.
+         * @param m the dispatch mode to use from now on
+         */
+        void set_dispatch(dispatch);
+
+        /*
+         * Checks whether creatures should interpret their programs
+         * @return true if the World is in interpreted mode
+         */
+        bool interpreting() const;
+
+        /*
+         * Sets the number of threads step uses. Results do not depend on
+         * it; worlds whose creatures draw from the global rand() are
+         * always stepped on one thread. The helper threads are started
+         * here and kept until the World is destroyed or n changes.
+         * @param n the number of threads, at least 1
+         * @throw invalid_argument when n is less than 1
+         */
+        void set_threads(int);
+
+        /*
+         * Replaces the source of if_random draws. A new World uses rand().
+         * @param r the generator to use from now on
+         */
+        void set_random(const Random&);
+
+        /*
+         * Gets the Metrics that instrumentation hooks add to: those of
+         * the calling thread during a threaded step, or else the World's
+         * @return the counters to update
+         */
+        Metrics& tally();
+
+        /*
+         * Gets the counters collected since the World was made or the
+         * metrics were reset; they stay zero unless built with
+         * DARWIN_METRICS
+         * @return the World's counters
+         */
+        const Metrics& metrics() const;
+
+        /*
+         * Sets all counters back to zero
+         */
+        void reset_metrics();
+
+        /*
+         * Counts the live creatures of each species ever added
+         * @return the population of each species, in the order added
+         */
+        std::vector<std::pair<Species*, int> > population() const;
+
+        /*
+         * Prints a one-line summary of the turn, the counters and the
+         * populations; the counters are left out unless built with
+         * DARWIN_METRICS
+         * @param o the stream to print to
+         */
+        void summarize(std::ostream&) const;
+
+        /*
+         * Makes step print a summary every n turns
+         * @param o the stream to print to
+         * @param n the number of turns between summaries, or 0 to stop
+         */
+        void summarize_every(std::ostream&, int);
 
         /*
          * Creates a new creature on the grid at the specified location,
@@ -135,10 +459,31 @@ class World {
          * @param s a pointer to a species to use (must not be null)
          * @param d the initial direction the creature is facing
          * @param l the location of the creature on the grid
+         * @return false if a creature was already there
          * @throw out_of_range when location is not in the World
          * @throw invalid_argument when species is invalid
          */
-        void add_creature(Species*, direction, Location);
+        bool add_creature(Species*, direction, Location);
+
+        /*
+         * Reserves room for creatures, so adding them does not reallocate
+         * @param n the number of creatures the World will hold
+         */
+        void reserve(size_t);
+
+        /*
+         * Removes every creature and sets the turn back to 0, keeping the
+         * World's storage, dispatch mode, threads and Random for reuse.
+         */
+        void clear();
+
+        /*
+         * Counts the live creatures of some species
+         * @param s the species to count
+         * @param counts resized to s.size(), counts[i] is set to the
+         *        number of creatures of s[i]
+         */
+        void census(const std::vector<Species*>&, std::vector<int>&) const;
 
         /*
          * Computes the new state of the world and creatures after each
@@ -148,11 +493,72 @@ class World {
 
         /*
          * Prints the current state of the board to the specified ostream,
-         * including the turns taken and row/column headings.
+         * including the turns taken and row/column headings, with a
+         * single write. Callers printing many frames can keep a buffer
+         * for render instead.
          * @param o where the data will be printed
          */
         void print(std::ostream&) const;
 
+        /*
+         * Renders what print would write into a buffer, reusing its
+         * storage, so a frame can be written out with a single call
+         * @param frame replaced with the text of the current board
+         */
+        void render(std::string&) const;
+
+        /*
+         * Writes each square's character ('.' when empty) in row-major
+         * order, as print shows them
+         * @param cells replaced with width * height characters
+         */
+        void render_cells(std::string&) const;
+
+        /*
+         * Writes the World's state (turn, creatures, grid and Random) as a
+         * flat snapshot: a fixed header followed by arrays of 32-bit
+         * records, which restore copies without parsing. Species are
+         * stored as their index in a registry, and each registry entry
+         * as its short name and a hash of its program, which restore
+         * checks. The species population() lists are stored in the order
+         * they were first added. The state of rand() is not
+         * part of a snapshot; reseed it when restoring such a World.
+         * @param buffer replaced with the snapshot, reusing its storage
+         * @param registry the species the World may contain
+         * @throw invalid_argument when a species the World has held is
+         *        not in the registry
+         */
+        void snapshot(std::string&, const std::vector<Species*>&) const;
+
+        /*
+         * Replaces the World's state with a snapshot, for example one
+         * mapped into memory by load. Afterwards population() lists the
+         * same species in the same order as when the snapshot was taken.
+         * @param data the first byte of the snapshot
+         * @param size the length of the snapshot in bytes
+         * @param registry the species the snapshot was taken with, in the
+         *        same order
+         * @throw invalid_argument when the data is not a snapshot of a
+         *        World of this size taken with this registry
+         */
+        void restore(const char*, size_t, const std::vector<Species*>&);
+
+        /*
+         * Writes a snapshot to a file
+         * @param path the file to write
+         * @param registry the species the World may contain
+         * @throw runtime_error when the file cannot be written
+         */
+        void save(const std::string&, const std::vector<Species*>&) const;
+
+        /*
+         * Maps a snapshot file into memory and restores it
+         * @param path the file to read
+         * @param registry the species the snapshot was taken with
+         * @throw runtime_error when the file cannot be mapped
+         */
+        void load(const std::string&, const std::vector<Species*>&);
+
         /*
          * Moves a creature at a location in the specified direction,
          * if possible.
@@ -195,17 +601,80 @@ class World {
          * @return true if an enemy is found, false otherwise
          */
         bool if_enemy(Location, direction) const;
+
+        /*
+         * Draws a random bit for the creature at a location
+         * @param l the location of the current square
+         * @param k how many draws the creature has already made this turn
+         * @return the outcome of if_random
+         */
+        bool if_random(Location, int) const;
+
+        /*
+         * Classifies the square adjacent to a creature, answering
+         * if_empty, if_wall and if_enemy with a single lookup
+         * @param l the location of the current square
+         * @param d the direction to the adjacent square
+         * @return what the creature at l sees in direction d
+         */
+        sight look(Location, direction) const;
 };
 
 class Species {
     private:
+        friend class Creature;
+        friend class World;
+
         std::vector<Instruction> instructions;
+        /*
+         * Compiled program: for each pc and sight, the action the program
+         * reaches with every go/if_empty/if_wall/if_enemy resolved.
+         * See next_action for how entries are read.
+         */
+        std::vector<Instruction> transitions;
+        /*
+         * for each transition, see chain_counts; left empty unless built
+         * with DARWIN_METRICS, so the layout is the same either way
+         */
+        std::vector<int> chains;
         const std::string name;
         bool completed;
+        bool random;
+        /*
+         * A number no other live Species has, so a Creature can name its
+         * species in two bytes; it is given back when the Species dies
+         */
+        uint16_t id;
+        /* a hash of the program, made by complete */
+        uint64_t digest;
+
+        /*
+         * Fills transitions from instructions, following each control-flow
+         * chain once and sharing the result with every pc along it
+         */
+        void compile();
 
     public:
-        Species(std::string n) :
-            name(n), completed(false) {}
+        /*
+         * @param n the name of the species
+         * @throw runtime_error when 65536 Species are already alive
+         */
+        Species(std::string n);
+
+        /*
+         * Copies the program of a species into a new one with its own id
+         * @param o the species to copy
+         */
+        Species(const Species&);
+
+        ~Species();
+
+        /*
+         * Finds a live species by its id
+         * @param id the id of the species
+         * @return the species holding that id
+         */
+        static Species* with_id(uint16_t);
 
         /*
          * Adds the specified instruction to the end of a Species' program.
@@ -226,6 +695,31 @@ class Species {
          */
         bool ready() const;
 
+        /*
+         * Gets the length of the program
+         * @return the number of instructions added so far
+         */
+        int program_size() const;
+
+        /*
+         * Checks whether the program contains an if_random instruction
+         */
+        bool draws_random() const;
+
+        /*
+         * Checks whether the compiled program always acts or draws: from
+         * every pc, whatever the creature sees, control reaches an action
+         * or if_random without looping or leaving the program
+         */
+        bool total() const;
+
+        /*
+         * Gets a hash of the program, which snapshots use to tell
+         * species apart
+         * @return the hash, or 0 before the species is ready
+         */
+        uint64_t program_hash() const;
+
         /*
          * Gets the instruction under the program counter
          * @param pc the position of the instruction
@@ -233,15 +727,297 @@ class Species {
          */
         Instruction next_move(int) const;
 
+        /*
+         * Gets the compiled transition for a program counter.
+         * An action (hop, left, right, infect) comes with the pc to resume
+         * at next turn; if_random comes with the pc of the if_random
+         * instruction the creature has to draw for; go means the chain
+         * loops or leaves the program and must be interpreted.
+         * @param pc the position of the instruction
+         * @param s what the creature sees in front of it
+         * @return the transition for pc under s
+         */
+        const Instruction& next_action(int, sight) const;
+
+        /*
+         * Gets how many if_empty, if_wall, if_enemy and go instructions
+         * the chain behind next_action(pc, s) runs through; all zero
+         * unless built with DARWIN_METRICS
+         * @param pc the position of the instruction
+         * @param s what the creature sees in front of it
+         * @return four counts, in that order
+         */
+        const int* chain_counts(int, sight) const;
+
         /*
          * Prints the one-letter name of this species to the ostream
          * @param o the stream to print to
          */
-        void print_short_name(std::ostream&);
+        void print_short_name(std::ostream&) const;
+
+        /*
+         * Gets the one-letter name of this species
+         * @return the first letter of the species' name
+         */
+        char short_name() const;
 };
 
-enum creature_behavior {hop, left, right, infect,
-                        if_empty, if_wall, if_random, if_enemy, go};
+/* A world layout and run length shared by the runs of an Ensemble */
+class Scenario {
+    private:
+        const int height;
+        const int width;
+        const int turns;
+        int interval;
+        std::vector<Species*> species;
+        std::vector<int> counts;
+
+        friend class Ensemble;
+
+    public:
+        /*
+         * @param h the height of each World
+         * @param w the width of each World
+         * @param t the number of turns each World is stepped
+         * @throw invalid_argument when a dimension is not positive or t
+         *        is negative
+         */
+        Scenario(int, int, int);
+
+        /*
+         * Places creatures of a species at random, like RunDarwin's
+         * add_somewhere: a placement on an occupied square is dropped.
+         * @param s the species (must be ready)
+         * @param n how many placements to make
+         * @throw invalid_argument when species is null or not ready
+         */
+        void add_species(Species*, int);
+
+        /*
+         * Sets how often populations are sampled
+         * @param n the number of turns between samples (default 1)
+         * @throw invalid_argument when n is not positive
+         */
+        void sample_every(int);
+
+        /*
+         * Builds the World for one seed in w, which must be empty and of
+         * the scenario's size
+         * @param w the World to fill
+         * @param seed picks the placements and the World's Random
+         */
+        void populate(World&, uint64_t) const;
+};
+
+/*
+ * A World and its species read from a scenario file. The file is read
+ * line by line; '#' starts a comment. Directives:
+ *   world <rows> <columns>            must come before any creature
+ *   seed <n>                          use Random(n) and seed placements
+ *   species <name>                    starts a program, ended by "end";
+ *     [label:] <instruction> [target] each line holds one instruction,
+ *                                     targets are labels or positions
+ *   end
+ *   creature <species> <direction> <row> <column>
+ *   random <species> <count>          count creatures on random empty
+ *                                     squares, facing random directions
+ *   board <direction>                 followed by one line per row of
+ *                                     '.' or species' one-letter names
+ * Directions are west, north, east and south.
+ */
+class ScenarioFile {
+    private:
+        std::vector<std::unique_ptr<Species> > owned;
+        std::vector<Species*> registry;
+        std::vector<std::string> names;
+        std::unique_ptr<World> loaded;
+
+        /*
+         * Reads a whole scenario
+         * @param data the first character of the file
+         * @param size the length of the file
+         * @throw invalid_argument naming the line of the first error
+         */
+        void parse(const char*, size_t);
+
+    public:
+        /*
+         * Maps a scenario file into memory and reads it
+         * @param path the file to read
+         * @throw runtime_error when the file cannot be mapped
+         * @throw invalid_argument naming the line of the first error
+         */
+        explicit ScenarioFile(const std::string&);
+
+        /*
+         * Reads a scenario held in memory
+         * @param data the first character of the scenario
+         * @param size the length of the scenario
+         * @throw invalid_argument naming the line of the first error
+         */
+        ScenarioFile(const char*, size_t);
+
+        /*
+         * @return the World the scenario describes
+         */
+        World& world();
+
+        /*
+         * @return the scenario's species, in the order they were
+         *         declared; usable as a snapshot registry
+         */
+        const std::vector<Species*>& species() const;
+
+        /*
+         * @param name the name a species was declared with
+         * @return the species, or null if there is none of that name
+         */
+        Species* find(const std::string&) const;
+};
+
+/* Runs a Scenario under many seeds and keeps only aggregate outcomes */
+class Ensemble {
+    private:
+        const Scenario& scenario;
+        long long runs;
+        /* population[sample * species + i]: sum over runs */
+        std::vector<long long> population;
+        std::vector<long long> wins;
+        std::vector<long long> extinctions;
+        /* sum over runs where species i died out of the turn it did */
+        std::vector<long long> extinction_turns;
+
+        /*
+         * Adds the outcomes of a worker to this ensemble
+         * @param o the partial results
+         */
+        void merge(const Ensemble&);
+
+        /*
+         * Runs one seed in w and adds its outcome to this ensemble
+         * @param w a World of the scenario's size, reused between runs
+         * @param seed the seed of the run
+         */
+        void run_one(World&, uint64_t);
+
+    public:
+        Ensemble(const Scenario&);
+
+        /*
+         * Runs seeds [first..last) on a work-stealing pool of threads.
+         * Results do not depend on the number of threads.
+         * @param first the first seed
+         * @param last one past the last seed
+         * @param threads the number of worker threads, at least 1
+         * @throw invalid_argument when threads is less than 1
+         */
+        void run(uint64_t, uint64_t, int);
+
+        /*
+         * @return the number of runs aggregated so far
+         */
+        long long size() const;
+
+        /*
+         * @param i the index of a species in the order it was added
+         * @param sample the index of a sample, taken every sample_every turns
+         * @return the mean population of species i at that sample
+         */
+        double mean_population(int, int) const;
+
+        /*
+         * @param i the index of a species
+         * @return the fraction of runs it ended as the only species left
+         */
+        double win_rate(int) const;
+
+        /*
+         * @param i the index of a species
+         * @return the fraction of runs in which it died out
+         */
+        double extinction_rate(int) const;
+
+        /*
+         * @param i the index of a species
+         * @return the mean turn it died out in, over the runs where it
+         *         did, or -1 if it never did
+         */
+        double mean_extinction_turn(int) const;
+
+        /*
+         * Prints the aggregate outcome per species and the mean
+         * population at every sample as tab-separated tables
+         * @param o the stream to print to
+         */
+        void print(std::ostream&) const;
+};
+
+/*
+ * Records the boards of a World as a compact binary trace. Every frame
+ * stores only the runs of squares that changed since the previous one.
+ * Layout: "DTRC", then version, height and width as varints; each frame
+ * is its turn, its number of runs, then for each run the count of
+ * unchanged squares before it, its length and its characters.
+ */
+class TraceWriter {
+    private:
+        std::ostream& out;
+        bool started;
+        int height;
+        int width;
+        std::string previous;
+        std::string cells;
+        std::string buffer;
+
+    public:
+        /*
+         * @param o the stream the trace is written to
+         */
+        TraceWriter(std::ostream& o) :
+            out(o), started(false), height(0), width(0) {}
+
+        /*
+         * Appends the current board of a World to the trace; the first
+         * call also writes the header
+         * @param w the World to record
+         * @throw invalid_argument when w is not the size of earlier frames,
+         *        or the first World has more than 2^28 squares
+         */
+        void write(const World&);
+};
+
+/* Reads back the frames written by a TraceWriter */
+class TraceReader {
+    private:
+        std::istream& in;
+        int height;
+        int width;
+        int turn;
+        std::string cells;
+        std::string buffer;
+
+    public:
+        /*
+         * Reads the header of a trace
+         * @param i the stream the trace is read from
+         * @throw invalid_argument when i does not hold a trace, or its
+         *        board has more than 2^28 squares
+         */
+        TraceReader(std::istream&);
+
+        /*
+         * Reads the next frame
+         * @return false when the trace has no more frames
+         * @throw invalid_argument when the frame is cut short or corrupt
+         */
+        bool next();
+
+        /*
+         * Prints the current frame exactly as World::print printed it
+         * @param o where the frame will be printed
+         */
+        void print(std::ostream&);
+};
 
 struct Instruction {
     creature_behavior h;
@@ -0,0 +1,42 @@
+// --------
+// includes
+// --------
+
+#include <fstream>   // ifstream
+#include <iostream>  // cerr, cin, cout
+#include <stdexcept> // invalid_argument
+
+#include "Darwin.h"
+
+// ----
+// main
+// ----
+
+/*
+ * Prints every frame of a trace written by TraceWriter in the text
+ * format of World::print.
+ * usage: ExpandTrace [trace]   (reads standard input without a file)
+ */
+int main (int argc, char* argv[]){
+    using namespace std;
+    ifstream file;
+    if (argc > 1){
+        file.open(argv[1], ios::binary);
+        if (!file){
+            cerr << "cannot open " << argv[1] << endl;
+            return 1;
+        }
+    }
+    istream& in = argc > 1 ? file : cin;
+
+    try {
+        TraceReader trace(in);
+        while (trace.next())
+            trace.print(cout);
+    } catch (const invalid_argument& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+// --------
+// includes
+// --------
+
+#include <cassert>   // assert
+#include <cstdlib>   // atoi, strtoull
+#include <cstring>   // strcmp
+#include <iostream>  // cerr, cout
+#include <memory>    // unique_ptr
+#include <stdexcept> // invalid_argument, out_of_range
+#include <thread>    // hardware_concurrency
+
+#include "Darwin.h"
+
+// ----
+// main
+// ----
+
+/*
+ * Runs one of the randomly placed RunDarwin scenarios under a range of
+ * seeds and prints the aggregate outcome.
+ * usage: RunEnsemble [scenario [first_seed [runs [threads]]]]
+ * scenarios: 72x72, 72x72best, 30x50, 2x100, 10x45, 70x5
+ */
+int main (int argc, char* argv[]){
+
+    // ----
+    // food
+    // ----
+
+    Species food("food");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+
+    // ------
+    // hopper
+    // ------
+
+    Species hopper("hopper");
+    hopper.add_instruction({hop});
+    hopper.add_instruction({go, 0});
+    hopper.complete();
+
+    // -----
+    // rover
+    // -----
+
+    Species rover("rover");
+    rover.add_instruction({if_enemy, 9});  // 0: if_enemy 9
+    rover.add_instruction({if_empty, 7});  // 1: if_empty 7
+    rover.add_instruction({if_random, 5}); // 2: if_random 5
+    rover.add_instruction({left});         // 3: left
+    rover.add_instruction({go, 0});        // 4: go 0
+    rover.add_instruction({right});        // 5: right
+    rover.add_instruction({go, 0});        // 6: go 0
+    rover.add_instruction({hop});          // 7: hop
+    rover.add_instruction({go, 0});        // 8: go 0
+    rover.add_instruction({infect});       // 9: infect
+    rover.add_instruction({go, 0});        //10: go 0
+    rover.complete();
+
+    // ----
+    // trap
+    // ----
+
+    Species trap("trap");
+    trap.add_instruction({if_enemy, 3}); // 0: if_enemy 3
+    trap.add_instruction({left});        // 1: left
+    trap.add_instruction({go, 0});       // 2: go 0
+    trap.add_instruction({infect});      // 3: infect
+    trap.add_instruction({go, 0});       // 4: go 0
+    trap.complete();
+
+    // ----
+    // best
+    // ----
+
+    Species best("best");
+    best.add_instruction({if_empty, 6});    // 0: if_empty 6
+    best.add_instruction({if_enemy, 4});    // 1: if_enemy 4
+    best.add_instruction({left});           // 2: left
+    best.add_instruction({go, 0});          // 3: go 0
+    best.add_instruction({infect});         // 4: infect
+    best.add_instruction({go, 0});          // 5: go 0
+    best.add_instruction({hop});            // 6: hop
+    best.add_instruction({go, 0});          // 7: go 0
+    best.complete();
+
+    using namespace std;
+
+    const char* const name = argc > 1 ? argv[1] : "72x72best";
+    const uint64_t first = argc > 2 ? strtoull(argv[2], 0, 10) : 0;
+    const uint64_t runs = argc > 3 ? strtoull(argv[3], 0, 10) : 1000;
+    int threads = argc > 4 ? atoi(argv[4]) : thread::hardware_concurrency();
+    if (threads < 1)
+        threads = 1;
+
+    try {
+        unique_ptr<Scenario> s;
+        if (strcmp(name, "72x72") == 0 || strcmp(name, "72x72best") == 0){
+            s.reset(new Scenario(72, 72, 1000));
+            s->add_species(&food,   10);
+            s->add_species(&hopper, 10);
+            s->add_species(&rover,  10);
+            s->add_species(&trap,   10);
+            if (strcmp(name, "72x72best") == 0)
+                s->add_species(&best, 10);
+            s->sample_every(100);
+        } else if (strcmp(name, "30x50") == 0){
+            s.reset(new Scenario(30, 50, 2000));
+            s->add_species(&food,  100);
+            s->add_species(&hopper, 10);
+            s->add_species(&rover,  10);
+            s->add_species(&trap,   10);
+            s->sample_every(100);
+        } else if (strcmp(name, "2x100") == 0){
+            s.reset(new Scenario(2, 100, 2000));
+            s->add_species(&food,  100);
+            s->add_species(&hopper, 10);
+            s->add_species(&rover,  10);
+            s->add_species(&trap,   10);
+            s->sample_every(100);
+        } else if (strcmp(name, "10x45") == 0){
+            s.reset(new Scenario(10, 45, 2000));
+            s->add_species(&hopper, 10);
+            s->add_species(&rover,  10);
+            s->add_species(&trap,   10);
+            s->sample_every(100);
+        } else if (strcmp(name, "70x5") == 0){
+            s.reset(new Scenario(70, 5, 2000));
+            s->add_species(&food,   50);
+            s->add_species(&hopper, 10);
+            s->add_species(&rover,  10);
+            s->sample_every(100);
+        } else {
+            cerr << "unknown scenario " << name << endl;
+            return 1;
+        }
+
+        Ensemble e(*s);
+        e.run(first, first + runs, threads);
+        e.print(cout);
+    } catch (const invalid_argument&) {
+        assert(false);
+    } catch (const out_of_range&) {
+        assert(false);
+    }
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+// --------
+// includes
+// --------
+
+#include <cstdlib>   // atoi
+#include <fstream>   // ofstream
+#include <iostream>  // cerr, cout
+#include <stdexcept> // invalid_argument, runtime_error
+#include <string>    // string
+
+#include "Darwin.h"
+
+// ----
+// main
+// ----
+
+/*
+ * Loads a scenario file and steps its World, printing the board at
+ * turn 0, every print_every turns (0 for none) and after the last turn.
+ * Given a trace file, it also records every turn there for ExpandTrace.
+ * usage: RunScenario <scenario> <turns> [print_every [trace]]
+ */
+int main (int argc, char* argv[]){
+    using namespace std;
+    if (argc < 3){
+        cerr << "usage: RunScenario <scenario> <turns> [print_every [trace]]"
+             << endl;
+        return 1;
+    }
+    const int turns = atoi(argv[2]);
+    const int every = argc > 3 ? atoi(argv[3]) : 0;
+    ofstream trace_file;
+    if (argc > 4){
+        trace_file.open(argv[4], ios::binary);
+        if (!trace_file){
+            cerr << "cannot open " << argv[4] << endl;
+            return 1;
+        }
+    }
+
+    try {
+        ScenarioFile scenario(argv[1]);
+        World& w = scenario.world();
+        TraceWriter trace(trace_file);
+        // one buffer serves every frame
+        string frame;
+        w.render(frame);
+        cout.write(frame.data(), frame.size());
+        if (trace_file.is_open())
+            trace.write(w);
+        for (int s = 1; s <= turns; s++){
+            w.step();
+            if (s == turns || (every > 0 && s % every == 0)){
+                w.render(frame);
+                cout.write(frame.data(), frame.size());
+            }
+            if (trace_file.is_open())
+                trace.write(w);
+        }
+    } catch (const invalid_argument& e) {
+        cerr << argv[1] << ": " << e.what() << endl;
+        return 1;
+    } catch (const runtime_error& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,6 +1,11 @@
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 
 #define private public
 #include "Darwin.h"
@@ -14,8 +19,8 @@ TEST(Creature_tests, infect_basic){
     Creature b(&rover, east);
 
     a.infect(b);
-    ASSERT_EQ(a.behavior, b.behavior);
-    ASSERT_EQ(&food, b.behavior);
+    ASSERT_EQ(a.species(), b.species());
+    ASSERT_EQ(&food, b.species());
 }
 
 TEST(Creature_tests, infect_pc){
@@ -59,7 +64,7 @@ TEST(Creature_tests, turn_move){
     Creature& a = w.zoo[0];
 
     a.take_turn(w, l);
-    ASSERT_EQ(w.grid.end(), w.grid.find(l));
+    ASSERT_EQ(World::vacant, w.grid[l.index(2)]);
 }
 
 TEST(Creature_tests, turn_facing){
@@ -154,6 +159,77 @@ TEST(Creature_tests, turn_complex2){
     ASSERT_EQ(north, a.facing);
 }
 
+TEST(Creature_tests, turn_out_of_program){
+    World w(2, 2);
+    Species s("s");
+    s.add_instruction({go, 5});
+    s.complete();
+    Location l(0, 0);
+    w.add_creature(&s, east, l);
+    Creature& a = w.zoo[0];
+
+    try {
+        a.take_turn(w, l);
+        FAIL();
+    } catch (std::out_of_range&){}
+}
+
+TEST(Creature_tests, turn_interpreted){
+    World w(2, 2);
+    Species s("s");
+    s.add_instruction({if_wall, 2});
+    s.add_instruction({hop});
+    s.add_instruction({left});
+    s.complete();
+    Location l(0, 1);
+    w.add_creature(&s, east, l);
+    w.set_dispatch(interpreted);
+    Creature& a = w.zoo[0];
+
+    a.take_turn(w, l);
+    ASSERT_EQ(north, a.facing);
+    ASSERT_EQ(3, a.pc);
+}
+
+TEST(Creature_tests, dispatch_agree){
+    Species trap("t");
+    trap.add_instruction({if_enemy, 3});
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.add_instruction({infect});
+    trap.add_instruction({go, 0});
+    trap.complete();
+    Species rover("r");
+    rover.add_instruction({if_enemy, 9});
+    rover.add_instruction({if_empty, 7});
+    rover.add_instruction({if_random, 5});
+    rover.add_instruction({left});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({right});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({hop});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({infect});
+    rover.add_instruction({go, 0});
+    rover.complete();
+
+    std::ostringstream out[2];
+    for (int m = 0; m < 2; m++){
+        World w(9, 9);
+        w.set_dispatch(m == 0 ? compiled : interpreted);
+        w.add_creature(&trap, south, Location(0, 0));
+        w.add_creature(&rover, north, Location(4, 4));
+        w.add_creature(&rover, west, Location(6, 2));
+        w.add_creature(&trap, east, Location(8, 8));
+        srand(0);
+        for (int i = 0; i < 50; i++){
+            w.step();
+            w.print(out[m]);
+        }
+    }
+    ASSERT_EQ(out[1].str(), out[0].str());
+}
+
 TEST(Creature_tests, printing){
     const char* const name = "s";
     Species s(name);
@@ -270,7 +346,7 @@ TEST(Creature_tests, facing_right_w){
 TEST(Creature_tests, construction_species){
     Species s("s");
     Creature c(&s, north);
-    ASSERT_EQ(&s, c.behavior);
+    ASSERT_EQ(&s, c.species());
 }
 
 TEST(Creature_tests, construction_direction){
@@ -285,6 +361,46 @@ TEST(Creature_tests, construction_turns){
     ASSERT_EQ(0, c.turns);
 }
 
+TEST(Creature_tests, construction_packed){
+    ASSERT_LE(sizeof(Creature), 12u);
+}
+
+TEST(Creature_tests, species_copy){
+    Species s("s");
+    s.add_instruction({hop});
+    s.complete();
+    Species t(s);
+    Creature a(&s, north);
+    Creature b(&t, north);
+
+    ASSERT_FALSE(a == b);
+    ASSERT_EQ(&t, b.species());
+    ASSERT_EQ(1, b.species()->program_size());
+}
+
+TEST(Random_tests, seeds_differ){
+    Random a(1);
+    Random b(2);
+    int same = 0;
+    for (int id = 0; id < 64; id++)
+        same += a.draw(1, id, 0) == b.draw(1, id, 0);
+    ASSERT_GT(64, same);
+}
+
+TEST(Random_tests, keys_differ){
+    Random a(1);
+    int ones = 0;
+    for (int turn = 0; turn < 64; turn++)
+        ones += a.draw(turn, 0, 0);
+    ASSERT_LT(0, ones);
+    ASSERT_GT(64, ones);
+}
+
+TEST(Random_tests, shared){
+    ASSERT_TRUE(Random().shared());
+    ASSERT_FALSE(Random(0).shared());
+}
+
 TEST(Location_tests, order_before){
     Location a(0, 0);
     Location b(4, 5);
@@ -377,6 +493,12 @@ TEST(Location_tests, navigate_south){
     ASSERT_EQ(4, b.y);
 }
 
+TEST(Location_tests, index_row_major){
+    ASSERT_EQ(0, Location(0, 0).index(4));
+    ASSERT_EQ(3, Location(0, 3).index(4));
+    ASSERT_EQ(9, Location(2, 1).index(4));
+}
+
 TEST(Location_tests, construction_horizontal){
     Location a(0, 1);
     ASSERT_EQ(1, a.x);
@@ -490,6 +612,46 @@ TEST(World_tests, printing_step){
     ASSERT_STREQ("Turn = 1.\n  01\n0 ..\n1 .s\n\n", out.str().c_str());
 }
 
+TEST(World_tests, printing_from_threads){
+    World w(64, 64);
+    Species s("s");
+    s.add_instruction({hop});
+    s.complete();
+    for (int r = 0; r < 64; r += 3)
+        w.add_creature(&s, east, Location(r, r));
+    const World& reader = w;
+
+    std::ostringstream out[2];
+    std::thread other([&]{ reader.print(out[1]); });
+    reader.print(out[0]);
+    other.join();
+    ASSERT_EQ(out[0].str(), out[1].str());
+}
+
+TEST(World_tests, render){
+    World w(3, 12);
+    Species s("s");
+    s.add_instruction({hop});
+    s.add_instruction({go, 0});
+    s.complete();
+    w.add_creature(&s, east, Location(2, 11));
+    w.add_creature(&s, south, Location(0, 0));
+    w.step();
+
+    std::string frame = "leftover";
+    w.render(frame);
+    std::ostringstream out;
+    w.print(out);
+    ASSERT_EQ(out.str(), frame);
+
+    std::string cells;
+    w.render_cells(cells);
+    ASSERT_EQ(36, cells.size());
+    ASSERT_EQ('s', cells[12]);
+    ASSERT_EQ('s', cells[35]);
+    ASSERT_EQ('.', cells[0]);
+}
+
 TEST(World_tests, move){
     World w(5, 5);
     Species s("s");
@@ -500,8 +662,8 @@ TEST(World_tests, move){
     w.add_creature(&s, d, l);
 
     w.move(l, d);
-    ASSERT_EQ(1, w.grid.count(l + d));
-    ASSERT_EQ(0, w.grid.count(l));
+    ASSERT_EQ(0, w.grid[(l + d).index(5)]);
+    ASSERT_EQ(World::vacant, w.grid[l.index(5)]);
 }
 
 TEST(World_tests, move_wall){
@@ -514,7 +676,7 @@ TEST(World_tests, move_wall){
     w.add_creature(&s, d, l);
 
     w.move(l, d);
-    ASSERT_EQ(1, w.grid.count(l));
+    ASSERT_EQ(0, w.grid[l.index(5)]);
 }
 
 TEST(World_tests, move_other){
@@ -528,8 +690,8 @@ TEST(World_tests, move_other){
     w.add_creature(&s, east, l + d);
 
     w.move(l, d);
-    ASSERT_EQ(1, w.grid.count(l));
-    ASSERT_EQ(1, w.grid.count(l + d));
+    ASSERT_EQ(0, w.grid[l.index(5)]);
+    ASSERT_EQ(1, w.grid[(l + d).index(5)]);
 }
 
 TEST(World_tests, free_space_found){
@@ -669,6 +831,224 @@ TEST(World_tests, enemy_paranoia){
     ASSERT_FALSE(w.if_enemy(l, south));
 }
 
+TEST(World_tests, threads_invalid){
+    World w(4, 4);
+    try {
+        w.set_threads(0);
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(World_tests, threads_agree){
+    Species hopper("h");
+    hopper.add_instruction({hop});
+    hopper.add_instruction({go, 0});
+    hopper.complete();
+    Species trap("t");
+    trap.add_instruction({if_enemy, 3});
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.add_instruction({infect});
+    trap.add_instruction({go, 0});
+    trap.complete();
+    Species best("b");
+    best.add_instruction({if_empty, 6});
+    best.add_instruction({if_enemy, 4});
+    best.add_instruction({left});
+    best.add_instruction({go, 0});
+    best.add_instruction({infect});
+    best.add_instruction({go, 0});
+    best.add_instruction({hop});
+    best.add_instruction({go, 0});
+    best.complete();
+    Species* species[] = {&hopper, &trap, &best};
+
+    const int threads[] = {1, 2, 3, 8};
+    std::ostringstream out[4];
+    for (int t = 0; t < 4; t++){
+        World w(70, 90);
+        w.set_threads(threads[t]);
+        srand(0);
+        for (int i = 0; i < 2000; i++){
+            const int position = rand() % (70 * 90);
+            w.add_creature(species[i % 3], static_cast<direction>(rand() % 4),
+                           Location(position / 90, position % 90));
+        }
+        for (int s = 0; s < 60; s++){
+            w.step();
+            w.print(out[t]);
+        }
+        for (size_t i = 0; i < w.zoo.size(); i++)
+            out[t] << w.zoo[i].pc << w.zoo[i].facing << w.zoo[i].turns;
+    }
+    for (int t = 1; t < 4; t++)
+        ASSERT_EQ(out[0].str(), out[t].str());
+}
+
+TEST(World_tests, threads_pool_kept){
+    Species hopper("h");
+    hopper.add_instruction({hop});
+    hopper.add_instruction({go, 0});
+    hopper.complete();
+
+    World w(8, 8);
+    ASSERT_TRUE(w.pool == 0);
+    w.set_threads(3);
+    const StepPool* const pool = w.pool.get();
+    ASSERT_TRUE(pool != 0);
+    for (int r = 0; r < 8; r++)
+        w.add_creature(&hopper, east, Location(r, 0));
+    for (int s = 0; s < 5; s++)
+        w.step();
+    w.set_threads(3);
+    ASSERT_EQ(pool, w.pool.get());
+    w.set_threads(2);
+    w.step();
+    w.set_threads(1);
+    ASSERT_TRUE(w.pool == 0);
+    w.step();
+    for (int r = 0; r < 8; r++)
+        ASSERT_EQ(w.zoo[r].turns, 7);
+}
+
+TEST(World_tests, threads_random_species){
+    Species rover("r");
+    rover.add_instruction({if_random, 2});
+    rover.add_instruction({left});
+    rover.add_instruction({hop});
+    rover.add_instruction({go, 0});
+    rover.complete();
+
+    std::ostringstream out[2];
+    for (int t = 0; t < 2; t++){
+        World w(6, 6);
+        w.set_threads(t == 0 ? 1 : 4);
+        for (int r = 0; r < 6; r += 2)
+            w.add_creature(&rover, south, Location(r, r));
+        ASSERT_TRUE(w.random_species);
+        srand(0);
+        for (int s = 0; s < 20; s++){
+            w.step();
+            w.print(out[t]);
+        }
+    }
+    ASSERT_EQ(out[0].str(), out[1].str());
+}
+
+TEST(World_tests, threads_counter_random){
+    Species rover("r");
+    rover.add_instruction({if_enemy, 9});
+    rover.add_instruction({if_empty, 7});
+    rover.add_instruction({if_random, 5});
+    rover.add_instruction({left});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({right});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({hop});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({infect});
+    rover.add_instruction({go, 0});
+    rover.complete();
+    Species food("f");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+
+    std::ostringstream out[2];
+    for (int t = 0; t < 2; t++){
+        World w(40, 40);
+        w.set_threads(t == 0 ? 1 : 4);
+        w.set_random(Random(7));
+        for (int i = 0; i < 40; i++){
+            w.add_creature(&rover, east, Location(i, (i * 7) % 40));
+            w.add_creature(&food, north, Location((i * 3) % 40, i));
+        }
+        for (int s = 0; s < 100; s++){
+            w.step();
+            w.print(out[t]);
+        }
+    }
+    ASSERT_EQ(out[0].str(), out[1].str());
+}
+
+TEST(World_tests, random_counter){
+    World w(3, 3);
+    Species s("s");
+    s.add_instruction({if_random, 0});
+    s.complete();
+    Location l(1, 1);
+    w.add_creature(&s, east, l);
+    w.set_random(Random(42));
+
+    int ones = 0;
+    for (int k = 0; k < 64; k++){
+        const bool b = w.if_random(l, k);
+        ASSERT_EQ(b, w.if_random(l, k));
+        ones += b;
+    }
+    ASSERT_LT(10, ones);
+    ASSERT_GT(54, ones);
+}
+
+TEST(World_tests, random_compatible){
+    World w(3, 3);
+    Species s("s");
+    s.add_instruction({if_random, 0});
+    s.complete();
+    Location l(1, 1);
+    w.add_creature(&s, east, l);
+
+    srand(3);
+    const int expected[] = {rand() % 2, rand() % 2, rand() % 2};
+    srand(3);
+    for (int k = 0; k < 3; k++)
+        ASSERT_EQ(expected[k], w.if_random(l, k));
+}
+
+TEST(World_tests, look_empty){
+    World w(4, 4);
+    Species food("a");
+    food.add_instruction({hop});
+    food.complete();
+    Location l(1, 2);
+    w.add_creature(&food, south, l);
+
+    ASSERT_EQ(sees_empty, w.look(l, south));
+}
+
+TEST(World_tests, look_wall){
+    World w(4, 4);
+    Species food("a");
+    food.add_instruction({hop});
+    food.complete();
+    Location l(0, 2);
+    w.add_creature(&food, south, l);
+
+    ASSERT_EQ(sees_wall, w.look(l, north));
+}
+
+TEST(World_tests, look_creatures){
+    World w(4, 4);
+    Species food("a");
+    food.add_instruction({hop});
+    food.complete();
+    Species rover("b");
+    rover.add_instruction({left});
+    rover.complete();
+    Location l(1, 2);
+    w.add_creature(&food, south, l);
+    w.add_creature(&food, south, l + east);
+    w.add_creature(&rover, south, l + south);
+
+    ASSERT_EQ(sees_friend, w.look(l, east));
+    ASSERT_EQ(sees_enemy, w.look(l, south));
+}
+
+TEST(World_tests, construction_dispatch){
+    World w(4, 3);
+    ASSERT_FALSE(w.interpreting());
+}
+
 TEST(World_tests, construction_location){
     World w(4, 3);
     ASSERT_EQ(4, w.height);
@@ -687,7 +1067,883 @@ TEST(World_tests, construction_creatures){
 
 TEST(World_tests, construction_locations){
     World w(4, 3);
-    ASSERT_TRUE(w.grid.empty());
+    ASSERT_EQ(12, w.grid.size());
+    for (size_t i = 0; i < w.grid.size(); i++)
+        ASSERT_EQ(World::vacant, w.grid[i]);
+}
+
+TEST(World_tests, clear){
+    World w(4, 4);
+    Species s("s");
+    s.add_instruction({hop});
+    s.add_instruction({go, 0});
+    s.complete();
+    w.add_creature(&s, south, Location(1, 1));
+    w.step();
+    w.clear();
+
+    ASSERT_EQ(0, w.turn);
+    ASSERT_EQ(0, w.zoo.size());
+    ASSERT_TRUE(w.free_space(Location(2, 1)));
+}
+
+TEST(World_tests, census){
+    World w(4, 4);
+    Species a("a");
+    a.add_instruction({left});
+    a.complete();
+    Species b("b");
+    b.add_instruction({left});
+    b.complete();
+    w.add_creature(&a, south, Location(0, 0));
+    w.add_creature(&a, south, Location(0, 1));
+    w.add_creature(&b, south, Location(0, 2));
+    std::vector<Species*> s;
+    s.push_back(&b);
+    s.push_back(&a);
+    std::vector<int> counts;
+    w.census(s, counts);
+
+    ASSERT_EQ(1, counts[0]);
+    ASSERT_EQ(2, counts[1]);
+}
+
+TEST(Ensemble_tests, scenario_invalid){
+    try {
+        Scenario s(0, 5, 10);
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Ensemble_tests, populate){
+    Species a("a");
+    a.add_instruction({left});
+    a.complete();
+    Scenario s(5, 5, 0);
+    s.add_species(&a, 3);
+    World w(5, 5);
+    World v(5, 5);
+    s.populate(w, 11);
+    s.populate(v, 11);
+
+    std::ostringstream x;
+    std::ostringstream y;
+    w.print(x);
+    v.print(y);
+    ASSERT_EQ(x.str(), y.str());
+    ASSERT_LE(1, w.zoo.size());
+}
+
+TEST(Ensemble_tests, sampling_agrees){
+    Species trap("t");
+    trap.add_instruction({if_enemy, 3});
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.add_instruction({infect});
+    trap.add_instruction({go, 0});
+    trap.complete();
+    Species food("f");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+
+    const int intervals[] = {1, 3, 10};
+    double wins[3];
+    double extinctions[3];
+    double extinction_turns[3];
+    for (int k = 0; k < 3; k++){
+        Scenario s(1, 2, 5);
+        s.add_species(&trap, 1);
+        s.add_species(&food, 1);
+        s.sample_every(intervals[k]);
+        Ensemble e(s);
+        e.run(0, 200, 1);
+        wins[k] = e.win_rate(0);
+        extinctions[k] = e.extinction_rate(1);
+        extinction_turns[k] = e.mean_extinction_turn(1);
+    }
+    // half the seeds place both on one square; the rest are stepped
+    ASSERT_GT(wins[0], 0.55);
+    for (int k = 1; k < 3; k++){
+        ASSERT_EQ(wins[0], wins[k]);
+        ASSERT_EQ(extinctions[0], extinctions[k]);
+        ASSERT_EQ(extinction_turns[0], extinction_turns[k]);
+    }
+}
+
+TEST(Ensemble_tests, threads_agree){
+    Species trap("t");
+    trap.add_instruction({if_enemy, 3});
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.add_instruction({infect});
+    trap.add_instruction({go, 0});
+    trap.complete();
+    Species rover("r");
+    rover.add_instruction({if_enemy, 9});
+    rover.add_instruction({if_empty, 7});
+    rover.add_instruction({if_random, 5});
+    rover.add_instruction({left});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({right});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({hop});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({infect});
+    rover.add_instruction({go, 0});
+    rover.complete();
+    Scenario s(12, 12, 200);
+    s.add_species(&trap, 5);
+    s.add_species(&rover, 5);
+    s.sample_every(50);
+
+    Ensemble one(s);
+    one.run(0, 40, 1);
+    Ensemble many(s);
+    many.run(0, 40, 3);
+    std::ostringstream x;
+    std::ostringstream y;
+    one.print(x);
+    many.print(y);
+
+    ASSERT_EQ(40, many.size());
+    ASSERT_EQ(x.str(), y.str());
+    ASSERT_DOUBLE_EQ(1, one.win_rate(0) + one.win_rate(1) +
+                        (1 - one.extinction_rate(0) - one.extinction_rate(1)));
+}
+
+TEST(Metrics_tests, enabled){
+#ifdef DARWIN_METRICS
+    ASSERT_TRUE(Metrics::enabled());
+#else
+    ASSERT_FALSE(Metrics::enabled());
+#endif
+}
+
+TEST(Metrics_tests, population){
+    Species a("a");
+    a.add_instruction({left});
+    a.complete();
+    Species b("b");
+    b.add_instruction({infect});
+    b.add_instruction({go, 0});
+    b.complete();
+    World w(1, 2);
+    w.add_creature(&a, east, Location(0, 0));
+    w.add_creature(&b, west, Location(0, 1));
+    w.step();
+
+    std::vector<std::pair<Species*, int> > p = w.population();
+    ASSERT_EQ(2, p.size());
+    ASSERT_EQ(&a, p[0].first);
+    ASSERT_EQ(0, p[0].second);
+    ASSERT_EQ(&b, p[1].first);
+    ASSERT_EQ(2, p[1].second);
+}
+
+TEST(Metrics_tests, summary_every){
+    Species a("a");
+    a.add_instruction({left});
+    a.add_instruction({go, 0});
+    a.complete();
+    World w(2, 2);
+    w.add_creature(&a, east, Location(0, 0));
+    std::ostringstream out;
+    w.summarize_every(out, 3);
+    for (int i = 0; i < 7; i++)
+        w.step();
+
+    const std::string s = out.str();
+    ASSERT_EQ(2, std::count(s.begin(), s.end(), '\n'));
+    ASSERT_EQ(0, s.find("turn=3 "));
+    ASSERT_NE(std::string::npos, s.find("turn=6 "));
+    ASSERT_NE(std::string::npos, s.find(" population a=1\n"));
+    if (!Metrics::enabled())
+        ASSERT_EQ(0, s.find("turn=3 population a=1\n"));
+    else
+        ASSERT_NE(std::string::npos, s.find(" actions="));
+}
+
+#ifdef DARWIN_METRICS
+TEST(Metrics_tests, counts){
+    Species food("f");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+    Species best("b");
+    best.add_instruction({if_empty, 6});
+    best.add_instruction({if_enemy, 4});
+    best.add_instruction({left});
+    best.add_instruction({go, 0});
+    best.add_instruction({infect});
+    best.add_instruction({go, 0});
+    best.add_instruction({hop});
+    best.add_instruction({go, 0});
+    best.complete();
+
+    for (int m = 0; m < 2; m++){
+        World w(1, 4);
+        w.set_dispatch(m == 0 ? compiled : interpreted);
+        w.add_creature(&best, east, Location(0, 0));
+        w.add_creature(&food, east, Location(0, 3));
+        for (int i = 0; i < 4; i++)
+            w.step();
+        const Metrics& s = w.metrics();
+
+        // best hops twice and infects food; both then turn left
+        ASSERT_EQ(2, s.moves());
+        ASSERT_EQ(0, s.blocked_moves());
+        ASSERT_EQ(1, s.infections(&best, &food));
+        ASSERT_EQ(0, s.infections(&food, &best));
+        ASSERT_EQ(4, s.step_count());
+        ASSERT_EQ(8, s.actions_taken());
+        ASSERT_EQ(2, s.executed(hop));
+        ASSERT_EQ(1, s.executed(infect));
+        ASSERT_EQ(5, s.executed(left));
+        ASSERT_EQ(6, s.executed(if_empty));
+        ASSERT_EQ(4, s.executed(if_enemy));
+        ASSERT_EQ(5, s.executed(go));
+    }
+}
+
+TEST(Metrics_tests, threads_agree){
+    Species hopper("h");
+    hopper.add_instruction({hop});
+    hopper.add_instruction({go, 0});
+    hopper.complete();
+    Species trap("t");
+    trap.add_instruction({if_enemy, 3});
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.add_instruction({infect});
+    trap.add_instruction({go, 0});
+    trap.complete();
+
+    long long counts[2][4];
+    for (int t = 0; t < 2; t++){
+        World w(30, 30);
+        w.set_threads(t == 0 ? 1 : 4);
+        for (int i = 0; i < 30; i++){
+            w.add_creature(&hopper, east, Location(i, i));
+            w.add_creature(&trap, north, Location(i, (i * 7) % 30));
+        }
+        for (int s = 0; s < 40; s++)
+            w.step();
+        counts[t][0] = w.metrics().moves();
+        counts[t][1] = w.metrics().blocked_moves();
+        counts[t][2] = w.metrics().infections(&trap, &hopper);
+        counts[t][3] = w.metrics().executed(if_enemy);
+    }
+    for (int k = 0; k < 4; k++)
+        ASSERT_EQ(counts[0][k], counts[1][k]);
+}
+#endif
+
+TEST(Snapshot_tests, continue_run){
+    Species rover("r");
+    rover.add_instruction({if_enemy, 9});
+    rover.add_instruction({if_empty, 7});
+    rover.add_instruction({if_random, 5});
+    rover.add_instruction({left});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({right});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({hop});
+    rover.add_instruction({go, 0});
+    rover.add_instruction({infect});
+    rover.add_instruction({go, 0});
+    rover.complete();
+    Species food("f");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+    std::vector<Species*> registry;
+    registry.push_back(&food);
+    registry.push_back(&rover);
+
+    Scenario s(20, 30, 0);
+    s.add_species(&food, 40);
+    s.add_species(&rover, 20);
+    World w(20, 30);
+    s.populate(w, 5);
+    std::string checkpoint;
+    std::ostringstream uninterrupted;
+    for (int i = 0; i < 80; i++){
+        if (i == 30)
+            w.snapshot(checkpoint, registry);
+        if (i >= 30)
+            w.print(uninterrupted);
+        w.step();
+    }
+
+    World v(20, 30);
+    v.restore(checkpoint.data(), checkpoint.size(), registry);
+    std::ostringstream restored;
+    for (int i = 30; i < 80; i++){
+        v.print(restored);
+        v.step();
+    }
+    ASSERT_EQ(uninterrupted.str(), restored.str());
+
+    // timings and counters differ, so compare the populations only
+    std::ostringstream x;
+    std::ostringstream y;
+    w.summarize(x);
+    v.summarize(y);
+    ASSERT_EQ(x.str().substr(x.str().find(" population")),
+              y.str().substr(y.str().find(" population")));
+}
+
+TEST(Snapshot_tests, extinct_species){
+    Species food("f");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+    Species trap("t");
+    trap.add_instruction({if_enemy, 3});
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.add_instruction({infect});
+    trap.add_instruction({go, 0});
+    trap.complete();
+    std::vector<Species*> registry;
+    registry.push_back(&food);
+    registry.push_back(&trap);
+
+    World w(1, 2);
+    w.add_creature(&food, west, Location(0, 1));
+    w.add_creature(&trap, east, Location(0, 0));
+    w.step();
+    std::string checkpoint;
+    w.snapshot(checkpoint, registry);
+    World v(1, 2);
+    v.restore(checkpoint.data(), checkpoint.size(), registry);
+
+    std::ostringstream x;
+    std::ostringstream y;
+    w.summarize(x);
+    v.summarize(y);
+    ASSERT_NE(std::string::npos, x.str().find(" population f=0 t=2\n"));
+    ASSERT_EQ(x.str().substr(x.str().find(" population")),
+              y.str().substr(y.str().find(" population")));
+}
+
+TEST(Snapshot_tests, population_order){
+    Species unused("u");
+    unused.add_instruction({left});
+    unused.complete();
+    Species trap("t");
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.complete();
+    Species food("f");
+    food.add_instruction({right});
+    food.add_instruction({go, 0});
+    food.complete();
+    std::vector<Species*> registry;
+    registry.push_back(&unused);
+    registry.push_back(&trap);
+    registry.push_back(&food);
+
+    World w(2, 2);
+    w.add_creature(&food, west, Location(0, 1));
+    w.add_creature(&trap, east, Location(1, 0));
+    w.step();
+    std::string checkpoint;
+    w.snapshot(checkpoint, registry);
+    World v(2, 2);
+    v.restore(checkpoint.data(), checkpoint.size(), registry);
+
+    std::ostringstream x;
+    std::ostringstream y;
+    w.summarize(x);
+    v.summarize(y);
+    ASSERT_NE(std::string::npos, x.str().find(" population f=1 t=1\n"));
+    ASSERT_EQ(x.str().substr(x.str().find(" population")),
+              y.str().substr(y.str().find(" population")));
+}
+
+TEST(Snapshot_tests, file){
+    Species s("s");
+    s.add_instruction({hop});
+    s.add_instruction({go, 0});
+    s.complete();
+    std::vector<Species*> registry(1, &s);
+    World w(5, 6);
+    w.add_creature(&s, east, Location(1, 2));
+    w.add_creature(&s, south, Location(3, 3));
+    w.step();
+    const std::string path = testing::TempDir() + "darwin_snapshot";
+    w.save(path, registry);
+
+    World v(5, 6);
+    v.load(path, registry);
+    std::ostringstream x;
+    std::ostringstream y;
+    w.print(x);
+    v.print(y);
+    ASSERT_EQ(x.str(), y.str());
+    ASSERT_EQ(1, v.turn);
+    ASSERT_EQ(2, v.zoo.size());
+    ASSERT_EQ(1, v.zoo[1].turns);
+    remove(path.c_str());
+}
+
+TEST(Snapshot_tests, missing_species){
+    Species s("s");
+    s.add_instruction({left});
+    s.complete();
+    Species t("t");
+    t.add_instruction({left});
+    t.complete();
+    World w(3, 3);
+    w.add_creature(&s, east, Location(1, 1));
+    std::string buffer;
+    try {
+        w.snapshot(buffer, std::vector<Species*>(1, &t));
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Snapshot_tests, swapped_registry){
+    Species s("s");
+    s.add_instruction({left});
+    s.complete();
+    Species t("t");
+    t.add_instruction({right});
+    t.complete();
+    std::vector<Species*> registry;
+    registry.push_back(&s);
+    registry.push_back(&t);
+    World w(3, 3);
+    w.add_creature(&s, east, Location(1, 1));
+    std::string buffer;
+    w.snapshot(buffer, registry);
+
+    std::swap(registry[0], registry[1]);
+    try {
+        w.restore(buffer.data(), buffer.size(), registry);
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Snapshot_tests, corrupt_grid){
+    Species s("s");
+    s.add_instruction({left});
+    s.complete();
+    std::vector<Species*> registry(1, &s);
+    World w(3, 3);
+    w.add_creature(&s, east, Location(0, 0));
+    w.add_creature(&s, east, Location(2, 2));
+    std::string buffer;
+    w.snapshot(buffer, registry);
+    const size_t grid = buffer.size() - 9 * sizeof(int32_t);
+
+    // two squares hold creature 0, and creature 1 stands nowhere
+    std::string twice = buffer;
+    const int32_t first = 0;
+    memcpy(&twice[grid + 8 * sizeof(int32_t)], &first, sizeof first);
+    try {
+        w.restore(twice.data(), twice.size(), registry);
+        FAIL();
+    } catch (std::invalid_argument&){}
+
+    // creature 1 stands nowhere
+    std::string missing = buffer;
+    const int32_t none = -1;
+    memcpy(&missing[grid + 8 * sizeof(int32_t)], &none, sizeof none);
+    try {
+        w.restore(missing.data(), missing.size(), registry);
+        FAIL();
+    } catch (std::invalid_argument&){}
+    ASSERT_EQ(0u, w.zoo.size());
+}
+
+TEST(Snapshot_tests, corrupt_creature){
+    Species s("s");
+    s.add_instruction({left});
+    s.add_instruction({go, 0});
+    s.complete();
+    std::vector<Species*> registry(1, &s);
+    World w(3, 3);
+    w.add_creature(&s, east, Location(1, 1));
+    w.step();
+    w.step();
+    std::string buffer;
+    w.snapshot(buffer, registry);
+    // the creature's record comes right before the grid
+    const size_t creature = buffer.size() - 9 * sizeof(int32_t) -
+                            4 * sizeof(int32_t);
+    // magic, version, height and width come before the turn
+    const size_t turn_at = 16;
+
+    // pc, then turns, of the only creature; then the header's turn
+    const size_t fields[] = {creature + 4, creature + 4, creature + 12,
+                             creature + 12, turn_at};
+    const int32_t values[] = {3, -1, 3, -1, -1};
+    for (int i = 0; i < 5; i++){
+        std::string corrupt = buffer;
+        memcpy(&corrupt[fields[i]], &values[i], sizeof values[i]);
+        try {
+            w.restore(corrupt.data(), corrupt.size(), registry);
+            FAIL() << i;
+        } catch (std::invalid_argument&){}
+    }
+
+    World v(3, 3);
+    v.restore(buffer.data(), buffer.size(), registry);
+    ASSERT_EQ(2, v.zoo[0].turns);
+}
+
+TEST(Snapshot_tests, program_ended){
+    Species s("s");
+    s.add_instruction({hop});
+    s.complete();
+    std::vector<Species*> registry(1, &s);
+    World w(3, 3);
+    w.add_creature(&s, east, Location(1, 0));
+    w.step();
+    ASSERT_EQ(1, w.zoo[0].pc);
+    std::string buffer;
+    w.snapshot(buffer, registry);
+
+    World v(3, 3);
+    v.restore(buffer.data(), buffer.size(), registry);
+    ASSERT_EQ(1, v.zoo[0].pc);
+    std::ostringstream x;
+    std::ostringstream y;
+    w.print(x);
+    v.print(y);
+    ASSERT_EQ(x.str(), y.str());
+}
+
+TEST(Snapshot_tests, wrong_world){
+    Species s("s");
+    s.add_instruction({left});
+    s.complete();
+    std::vector<Species*> registry(1, &s);
+    World w(3, 3);
+    w.add_creature(&s, east, Location(1, 1));
+    std::string buffer;
+    w.snapshot(buffer, registry);
+
+    World v(3, 4);
+    try {
+        v.restore(buffer.data(), buffer.size(), registry);
+        FAIL();
+    } catch (std::invalid_argument&){}
+    try {
+        w.restore(buffer.data(), buffer.size() - 1, registry);
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Trace_tests, round_trip){
+    Species hopper("hopper");
+    hopper.add_instruction({hop});
+    hopper.add_instruction({go, 0});
+    hopper.complete();
+    Species trap("trap");
+    trap.add_instruction({if_enemy, 3});
+    trap.add_instruction({left});
+    trap.add_instruction({go, 0});
+    trap.add_instruction({infect});
+    trap.add_instruction({go, 0});
+    trap.complete();
+
+    World w(8, 13);
+    w.add_creature(&hopper, south, Location(0, 0));
+    w.add_creature(&hopper, north, Location(7, 7));
+    w.add_creature(&hopper, east, Location(3, 1));
+    w.add_creature(&trap, east, Location(0, 7));
+    w.add_creature(&trap, west, Location(7, 0));
+    std::ostringstream trace;
+    std::ostringstream text;
+    TraceWriter writer(trace);
+    for (int i = 0; i < 12; i++){
+        w.print(text);
+        writer.write(w);
+        w.step();
+    }
+
+    std::istringstream in(trace.str());
+    TraceReader reader(in);
+    std::ostringstream expanded;
+    while (reader.next())
+        reader.print(expanded);
+    ASSERT_EQ(text.str(), expanded.str());
+    ASSERT_GT(text.str().size(), trace.str().size());
+}
+
+TEST(Trace_tests, wrong_size){
+    World w(2, 2);
+    World v(2, 3);
+    std::ostringstream trace;
+    TraceWriter writer(trace);
+    writer.write(w);
+    try {
+        writer.write(v);
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Trace_tests, not_a_trace){
+    std::istringstream in("Turn = 0.");
+    try {
+        TraceReader reader(in);
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Trace_tests, too_large){
+    // a version 1 header for a 2^20 by 2^20 board
+    std::istringstream in(std::string("DTRC\x01\x80\x80\x40\x80\x80\x40", 11));
+    try {
+        TraceReader reader(in);
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Trace_tests, truncated){
+    World w(4, 4);
+    Species s("s");
+    s.add_instruction({left});
+    s.complete();
+    w.add_creature(&s, east, Location(1, 1));
+    std::ostringstream trace;
+    TraceWriter writer(trace);
+    writer.write(w);
+
+    const std::string bytes = trace.str();
+    std::istringstream in(bytes.substr(0, bytes.size() - 1));
+    TraceReader reader(in);
+    try {
+        reader.next();
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+TEST(Trace_tests, huge_skip){
+    // a 4x4 trace whose frame changes square 0, then skips 2^64 - 1
+    // squares, which would wrap back to square 0
+    std::string bytes = "DTRC";
+    bytes += '\x01';
+    bytes += '\x04';
+    bytes += '\x04';
+    bytes += '\x00'; // turn
+    bytes += '\x02'; // runs
+    bytes += '\x00'; // skip
+    bytes += '\x01'; // length
+    bytes += 's';
+    bytes += std::string(9, '\xff');
+    bytes += '\x01';
+    bytes += '\x01';
+    bytes += 't';
+    std::istringstream in(bytes);
+    TraceReader reader(in);
+    try {
+        reader.next();
+        FAIL();
+    } catch (std::invalid_argument&){}
+}
+
+const char scenario_8x8[] =
+    "# RunDarwin's 8x8 board\n"
+    "world 8 8\n"
+    "species food\n"
+    "  start: left\n"
+    "         go start\n"
+    "end\n"
+    "species hopper\n"
+    "  hop\n"
+    "  go 0   # back to the top\n"
+    "end\n"
+    "creature food east 0 0\n"
+    "creature hopper north 3 3\n"
+    "creature hopper east 3 4\n"
+    "creature hopper south 4 4\n"
+    "creature hopper west 4 3\n"
+    "creature food north 7 7\n";
+
+TEST(ScenarioFile_tests, matches_hand_built){
+    ScenarioFile f(scenario_8x8, sizeof scenario_8x8 - 1);
+
+    Species food("food");
+    food.add_instruction({left});
+    food.add_instruction({go, 0});
+    food.complete();
+    Species hopper("hopper");
+    hopper.add_instruction({hop});
+    hopper.add_instruction({go, 0});
+    hopper.complete();
+    World w(8, 8);
+    w.add_creature(&food,   east,  Location(0, 0));
+    w.add_creature(&hopper, north, Location(3, 3));
+    w.add_creature(&hopper, east,  Location(3, 4));
+    w.add_creature(&hopper, south, Location(4, 4));
+    w.add_creature(&hopper, west,  Location(4, 3));
+    w.add_creature(&food,   north, Location(7, 7));
+
+    std::ostringstream x;
+    std::ostringstream y;
+    for (int i = 0; i <= 5; i++){
+        w.print(x);
+        w.step();
+        f.world().print(y);
+        f.world().step();
+    }
+    ASSERT_EQ(x.str(), y.str());
+    ASSERT_EQ(2, f.species().size());
+    ASSERT_EQ(f.species()[1], f.find("hopper"));
+    ASSERT_EQ(0, f.find("rover"));
+}
+
+TEST(ScenarioFile_tests, labels){
+    const std::string text =
+        "world 3 3\n"
+        "species rover\n"
+        "top: if_enemy attack\n"
+        "     if_empty move\n"
+        "     if_random turn_right\n"
+        "     left\n"
+        "     go top\n"
+        "turn_right: right\n"
+        "     go top\n"
+        "move: hop\n"
+        "     go top\n"
+        "attack:\n"
+        "     infect\n"
+        "     go top\n"
+        "end\n";
+    ScenarioFile f(text.data(), text.size());
+    Species* s = f.find("rover");
+
+    ASSERT_EQ(11, s->instructions.size());
+    ASSERT_EQ(9, s->instructions[0].n);
+    ASSERT_EQ(7, s->instructions[1].n);
+    ASSERT_EQ(5, s->instructions[2].n);
+    ASSERT_EQ(0, s->instructions[10].n);
+    ASSERT_TRUE(s->ready());
+}
+
+TEST(ScenarioFile_tests, board_and_random){
+    const std::string text =
+        "world 3 5\n"
+        "seed 9\n"
+        "species food\n"
+        "left\n"
+        "go 0\n"
+        "end\n"
+        "species trap\n"
+        "left\n"
+        "go 0\n"
+        "end\n"
+        "board south\n"
+        "f...t\n"
+        ".....\n"
+        "..t..\n"
+        "random food 4\n";
+    ScenarioFile f(text.data(), text.size());
+    World& w = f.world();
+
+    ASSERT_EQ(7, w.zoo.size());
+    ASSERT_EQ(w.zoo[0].species(), f.find("food"));
+    ASSERT_EQ(w.zoo[2].species(), f.find("trap"));
+    ASSERT_EQ(south, w.zoo[2].facing);
+    ASSERT_EQ(2, w.grid[Location(2, 2).index(5)]);
+    ASSERT_FALSE(w.rng.shared());
+}
+
+/*
+ * Loads a scenario that must be rejected
+ * @return the message of the error
+ */
+std::string scenario_error(const std::string& text){
+    try {
+        ScenarioFile f(text.data(), text.size());
+    } catch (std::invalid_argument& e){
+        return e.what();
+    }
+    return "";
+}
+
+TEST(ScenarioFile_tests, errors){
+    const std::string species = "species s\nhop\ngo 0\nend\n";
+    ASSERT_EQ("line 1: creature before world",
+              scenario_error("creature s east 0 0\n"));
+    ASSERT_EQ("scenario has no world", scenario_error(species));
+    ASSERT_EQ("line 3: unknown label 'nowhere'",
+              scenario_error("world 2 2\nspecies s\ngo nowhere\nend\n"));
+    ASSERT_EQ("line 3: jump to 4 leaves the program",
+              scenario_error("world 2 2\nspecies s\nif_wall 4\nhop\nend\n"));
+    ASSERT_EQ("line 4: program runs past its last instruction",
+              scenario_error("world 2 2\nspecies s\nif_wall 1\nhop\nend\n"));
+    ASSERT_EQ("line 3: program runs past its last instruction",
+              scenario_error("world 2 2\nspecies h\nhop\nend\n"));
+    ASSERT_EQ("line 2: species 'x' can loop without acting",
+              scenario_error("world 2 2\nspecies x\nx: if_empty x\n"
+                             "go x\nend\n"));
+    ASSERT_EQ("line 3: unknown instruction 'jump'",
+              scenario_error("world 2 2\nspecies s\njump 0\nend\n"));
+    ASSERT_EQ("line 7: square already taken",
+              scenario_error("world 2 2\n" + species +
+                             "creature s east 0 0\ncreature s west 0 0\n"));
+    ASSERT_EQ("line 6: square outside the world",
+              scenario_error("world 2 2\n" + species +
+                             "creature s east 2 0\n"));
+    ASSERT_EQ("line 6: not enough empty squares",
+              scenario_error("world 2 2\n" + species + "random s 5\n"));
+    ASSERT_EQ("line 8: board row is not 2 squares",
+              scenario_error("world 2 2\n" + species +
+                             "board east\ns.\n...\n"));
+    ASSERT_EQ("line 6: bad direction 'up'",
+              scenario_error("world 2 2\n" + species +
+                             "creature s up 0 0\n"));
+}
+
+TEST(ScenarioFile_tests, board_letters){
+    const std::string text =
+        "world 2 3\n"
+        "species trap\nleft\ngo 0\nend\n"
+        "species hopper\nhop\ngo 0\nend\n"
+        "board north\n"
+        "h.t\n"
+        "...\n";
+    ScenarioFile f(text.data(), text.size());
+    const std::vector<std::pair<Species*, int> > counts =
+        f.world().population();
+
+    // in declaration order, not board or letter order
+    ASSERT_EQ(2, counts.size());
+    ASSERT_EQ(f.find("trap"), counts[0].first);
+    ASSERT_EQ(f.find("hopper"), counts[1].first);
+
+    const std::string shared =
+        "world 1 2\n"
+        "species food\nleft\ngo 0\nend\n"
+        "species fast\nhop\ngo 0\nend\n"
+        "species frog\nhop\ngo 0\nend\n"
+        "board north\n"
+        "f.\n";
+    ASSERT_EQ("line 15: no single species for 'f'", scenario_error(shared));
+}
+
+TEST(ScenarioFile_tests, file){
+    const std::string path = testing::TempDir() + "darwin_scenario";
+    {
+        std::ofstream out(path.c_str());
+        out << scenario_8x8;
+    }
+    ScenarioFile f(path);
+    std::ostringstream x;
+    f.world().print(x);
+    ASSERT_EQ(0, x.str().find("Turn = 0.\n  01234567\n0 f......."));
+    remove(path.c_str());
+
+    try {
+        ScenarioFile missing(path);
+        FAIL();
+    } catch (std::runtime_error&){}
 }
 
 TEST(Species_tests, add_instruction1){
@@ -729,6 +1985,55 @@ TEST(Species_tests, completion_fails){
     } catch (std::invalid_argument&){}
 }
 
+TEST(Species_tests, compiled_chain){
+    Species s("s");
+    s.add_instruction({go, 1});
+    s.add_instruction({if_wall, 3});
+    s.add_instruction({hop});
+    s.add_instruction({left});
+    s.add_instruction({go, 0});
+    s.complete();
+
+    ASSERT_EQ(hop, s.next_action(0, sees_empty).h);
+    ASSERT_EQ(3, s.next_action(0, sees_empty).n);
+    ASSERT_EQ(left, s.next_action(0, sees_wall).h);
+    ASSERT_EQ(4, s.next_action(0, sees_wall).n);
+    ASSERT_EQ(left, s.next_action(4, sees_wall).h);
+}
+
+TEST(Species_tests, compiled_random){
+    Species s("s");
+    s.add_instruction({go, 1});
+    s.add_instruction({if_random, 3});
+    s.add_instruction({hop});
+    s.add_instruction({left});
+    s.complete();
+
+    ASSERT_EQ(if_random, s.next_action(0, sees_friend).h);
+    ASSERT_EQ(1, s.next_action(0, sees_friend).n);
+}
+
+TEST(Species_tests, compiled_loop){
+    Species s("s");
+    s.add_instruction({if_enemy, 2});
+    s.add_instruction({go, 0});
+    s.add_instruction({infect});
+    s.complete();
+
+    ASSERT_EQ(infect, s.next_action(0, sees_enemy).h);
+    ASSERT_EQ(go, s.next_action(0, sees_empty).h);
+    ASSERT_EQ(go, s.next_action(1, sees_wall).h);
+    ASSERT_EQ(go, s.next_action(3, sees_enemy).h);
+}
+
+TEST(Species_tests, draws_random){
+    Species s("s");
+    s.add_instruction({hop});
+    ASSERT_FALSE(s.draws_random());
+    s.add_instruction({if_random, 0});
+    ASSERT_TRUE(s.draws_random());
+}
+
 TEST(Species_tests, printing){
     Species s("s");
     std::ostringstream w;
@@ -745,6 +2050,11 @@ TEST(Species_tests, printing_short){
     ASSERT_STREQ("s", w.str().c_str());
 }
 
+TEST(Species_tests, short_name){
+    Species s("trap");
+    ASSERT_EQ('t', s.short_name());
+}
+
 TEST(Species_tests, construction_name){
     Species s("s");
     ASSERT_EQ("s", s.name);